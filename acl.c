@@ -0,0 +1,262 @@
+#include "global.c";
+#include <endian.h> /* for be32toh() */
+
+/*
+ * Access control lists.  Each restrict line in the configuration
+ * gives an address prefix and the restrict word for the sources in
+ * it.  The longest matching prefix wins; sources that match none get
+ * R_DEFAULT, unless a zero-length prefix says otherwise.
+ *
+ * acl_add() collects the lines and acl_compile() builds them into a
+ * DIR-16-8-8 table: a first level of 65536 words indexed by the top 16
+ * bits of the address, and second and third levels of 256-word chunks
+ * indexed by the next 8 bits each.  A word is either the restrict word
+ * for the whole range below it, or, with A_CHILD set, the number of
+ * the chunk with the finer detail.  A lookup is thus one to three
+ * loads, whatever the number of lines.  Longer prefixes are painted
+ * over shorter ones, which is all it takes to get longest match.
+ *
+ * The table is compiled off to the side and published with one
+ * pointer store, so server worker threads keep looking up in the old
+ * one while the new one is built.  The old table is retired in a key
+ * store generation and acl_reclaim() frees it once every reader has
+ * called key_quiesce() since, as key_reclaim() does for key tables.
+ *
+ * Addresses are IPv4 only, like ipaddr.
+ */
+#define A_CHILD 0x80000000 /* word is a chunk number */
+#define A_TOP 65536        /* first level words */
+#define A_CHUNK 256        /* words per chunk */
+
+/*
+ * Restrict line
+ */
+struct acl
+{
+  ipaddr addr; /* prefix address (network order) */
+  int plen;    /* prefix length (bits) */
+  int flags;   /* restrict word */
+  int seq;     /* line number */
+};
+
+/*
+ * Lookup table
+ */
+struct atable
+{
+  unsigned long gen;   /* generation it was retired in */
+  struct atable *next; /* next retired table */
+  unsigned int w[];    /* words */
+};
+
+static struct acl *alist;       /* restrict lines */
+static int nalist, maxalist;    /* lines used, allocated */
+static struct atable *atbl;     /* published table */
+static struct atable *aretired; /* tables waiting to be freed */
+static struct atable *abuild;   /* table being built */
+static int nchunk, maxchunk;    /* chunks used, allocated */
+
+/*
+ * acl_add() - add restrict line
+ */
+int /* TRUE if added, FALSE if not */
+acl_add(
+    ipaddr addr, /* prefix address (network order) */
+    int plen,    /* prefix length (bits) */
+    int flags    /* restrict word */
+)
+{
+    struct acl *ap;
+
+    if (plen < 0 || plen > 32)
+        return (FALSE);
+
+    if (nalist == maxalist)
+    {
+        ap = realloc(alist, (maxalist + 64) * sizeof(struct acl));
+        if (ap == NULL)
+            return (FALSE);
+
+        alist = ap;
+        maxalist += 64;
+    }
+    ap = &alist[nalist];
+    ap->addr = addr;
+    ap->plen = plen;
+    ap->flags = flags;
+    ap->seq = nalist++;
+    return (TRUE);
+}
+
+/*
+ * acl_order() - sort lines by prefix length, then line number
+ */
+static int acl_order(const void *a, const void *b)
+{
+    const struct acl *x = a, *y = b;
+
+    if (x->plen != y->plen)
+        return (x->plen - y->plen);
+    return (x->seq - y->seq);
+}
+
+/*
+ * acl_child() - get chunk below a word, making one if need be
+ *
+ * A new chunk inherits the restrict word it replaces.
+ */
+static int /* word offset of chunk or -1 */
+acl_child(int w /* word offset */)
+{
+    struct atable *tp;
+    int i, n;
+
+    if (abuild->w[w] & A_CHILD)
+        return ((abuild->w[w] & ~A_CHILD) * A_CHUNK);
+
+    if (nchunk == maxchunk)
+    {
+        n = maxchunk * 2;
+        tp = realloc(abuild, sizeof(struct atable) +
+                                 (size_t)n * A_CHUNK * sizeof(tp->w[0]));
+        if (tp == NULL)
+            return (-1);
+
+        abuild = tp;
+        maxchunk = n;
+    }
+    for (i = 0; i < A_CHUNK; i++)
+        abuild->w[nchunk * A_CHUNK + i] = abuild->w[w];
+    abuild->w[w] = A_CHILD | nchunk;
+    return (nchunk++ * A_CHUNK);
+}
+
+/*
+ * acl_compile() - build restrict lines into lookup table
+ */
+int /* TRUE if built, FALSE if out of memory */
+acl_compile()
+{
+    struct atable *old;
+    struct acl *ap;
+    unsigned int a; /* prefix address (host order) */
+    int w, i, n;
+
+    /*
+     * The first level takes the first A_TOP / A_CHUNK chunk numbers,
+     * so chunk numbers and word offsets line up.
+     */
+    maxchunk = A_TOP / A_CHUNK * 2;
+    abuild = malloc(sizeof(struct atable) +
+                    (size_t)maxchunk * A_CHUNK * sizeof(abuild->w[0]));
+    if (abuild == NULL)
+        return (FALSE);
+
+    nchunk = A_TOP / A_CHUNK;
+    for (i = 0; i < A_TOP; i++)
+        abuild->w[i] = R_DEFAULT;
+
+    /*
+     * Paint the prefixes shortest first.  Each covers a run of words
+     * at the level where it ends.
+     */
+    qsort(alist, nalist, sizeof(struct acl), acl_order);
+    for (ap = alist; ap < alist + nalist; ap++)
+    {
+        a = ap->plen == 0 ? 0 : be32toh(ap->addr) &
+                                    ~((1ULL << (32 - ap->plen)) - 1);
+        if (ap->plen <= 16)
+        {
+            w = a >> 16;
+            n = 1 << (16 - ap->plen);
+        }
+        else
+        {
+            w = acl_child(a >> 16);
+            if (w >= 0 && ap->plen > 24)
+                w = acl_child(w + (a >> 8 & 0xff));
+            if (w < 0)
+            {
+                free(abuild);
+                return (FALSE);
+            }
+            if (ap->plen <= 24)
+            {
+                w += a >> 8 & 0xff;
+                n = 1 << (24 - ap->plen);
+            }
+            else
+            {
+                w += a & 0xff;
+                n = 1 << (32 - ap->plen);
+            }
+        }
+
+        /*
+         * Painting shortest first, no word in the run has a chunk
+         * below it yet.
+         */
+        for (i = 0; i < n; i++)
+            abuild->w[w + i] = ap->flags;
+    }
+
+    /*
+     * Publish, then retire the old table in the generation after,
+     * which readers reach only once they can no longer see it.
+     */
+    old = __atomic_exchange_n(&atbl, abuild, __ATOMIC_SEQ_CST);
+    abuild = NULL;
+    if (old != NULL)
+    {
+        old->gen = key_retire();
+        old->next = aretired;
+        aretired = old;
+    }
+    acl_reclaim();
+    return (TRUE);
+}
+
+/*
+ * acl_reclaim() - free the retired tables no reader can see
+ */
+void acl_reclaim()
+{
+    struct atable *tp, **tpp;
+    unsigned long seen;
+
+    seen = key_seen();
+    for (tpp = &aretired; (tp = *tpp) != NULL;)
+    {
+        if (tp->gen <= seen)
+        {
+            *tpp = tp->next;
+            free(tp);
+        }
+        else
+        {
+            tpp = &tp->next;
+        }
+    }
+}
+
+/*
+ * acl_lookup() - find restrict word for address
+ */
+int /* restrict word */
+acl_lookup(ipaddr addr /* address (network order) */)
+{
+    struct atable *tp;
+    unsigned int a, w;
+
+    tp = __atomic_load_n(&atbl, __ATOMIC_ACQUIRE);
+    if (tp == NULL)
+        return (R_DEFAULT);
+
+    a = be32toh(addr);
+    w = tp->w[a >> 16];
+    if (w & A_CHILD)
+        w = tp->w[(w & ~A_CHILD) * A_CHUNK + (a >> 8 & 0xff)];
+    if (w & A_CHILD)
+        w = tp->w[(w & ~A_CHILD) * A_CHUNK + (a & 0xff)];
+    return (w);
+}
@@ -0,0 +1,473 @@
+#include "global.c";
+#ifdef __x86_64__
+#include <immintrin.h> /* for AES-NI and VAES */
+#endif
+
+/*
+ * AES-128-CMAC message authentication (RFC 4493), as used for NTP in
+ * RFC 8573.  The tag is the CMAC of the NTP header and extension
+ * fields under a 128-bit key and fills the 128-bit digest field.
+ *
+ * CMAC chains the blocks of one message, so a single message cannot
+ * keep the AES unit busy.  cmac_batch() instead runs several messages
+ * side by side: with VAES and AVX-512 eight at a time, four to a
+ * register, and with AES-NI four at a time, one to a register, with
+ * the rounds interleaved so each instruction waits on none before it.
+ * Machines with neither use the plain AES code below, which is slow
+ * but needs nothing.  The round keys and the subkeys K1 and K2 are
+ * computed once by cmac_init() when the key is installed.
+ */
+#define NCLANE 8               /* VAES lanes (two registers of four) */
+#define NNLANE 4               /* AES-NI lanes */
+#define MAXCBLK (LEN_BUF / 16) /* most blocks in a message */
+
+/*
+ * AES S-box
+ */
+static const unsigned char sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b,
+    0xfe, 0xd7, 0xab, 0x76, 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0, 0xb7, 0xfd, 0x93, 0x26,
+    0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2,
+    0xeb, 0x27, 0xb2, 0x75, 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84, 0x53, 0xd1, 0x00, 0xed,
+    0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f,
+    0x50, 0x3c, 0x9f, 0xa8, 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2, 0xcd, 0x0c, 0x13, 0xec,
+    0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14,
+    0xde, 0x5e, 0x0b, 0xdb, 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79, 0xe7, 0xc8, 0x37, 0x6d,
+    0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f,
+    0x4b, 0xbd, 0x8b, 0x8a, 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e, 0xe1, 0xf8, 0x98, 0x11,
+    0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f,
+    0xb0, 0x54, 0xbb, 0x16};
+
+#define XTIME(a) ((unsigned char)((a) << 1 ^ ((a) & 0x80 ? 0x1b : 0)))
+
+/*
+ * aes_encrypt() - encrypt one block in place, without AES-NI
+ */
+static void aes_encrypt(
+    unsigned char *rk, /* round keys */
+    unsigned char *b   /* block */
+)
+{
+    unsigned char t[16], a0, a1, a2, a3;
+    int r, i, c;
+
+    for (i = 0; i < 16; i++)
+        b[i] ^= rk[i];
+    for (r = 1; r <= 10; r++)
+    {
+        /*
+         * SubBytes and ShiftRows together, then MixColumns except in
+         * the last round.
+         */
+        for (c = 0; c < 4; c++)
+        {
+            for (i = 0; i < 4; i++)
+                t[4 * c + i] = sbox[b[4 * ((c + i) % 4) + i]];
+        }
+        for (c = 0; c < 4; c++)
+        {
+            a0 = t[4 * c];
+            a1 = t[4 * c + 1];
+            a2 = t[4 * c + 2];
+            a3 = t[4 * c + 3];
+            if (r == 10)
+            {
+                b[4 * c] = a0;
+                b[4 * c + 1] = a1;
+                b[4 * c + 2] = a2;
+                b[4 * c + 3] = a3;
+                continue;
+            }
+            b[4 * c] = XTIME(a0) ^ XTIME(a1) ^ a1 ^ a2 ^ a3;
+            b[4 * c + 1] = a0 ^ XTIME(a1) ^ XTIME(a2) ^ a2 ^ a3;
+            b[4 * c + 2] = a0 ^ a1 ^ XTIME(a2) ^ XTIME(a3) ^ a3;
+            b[4 * c + 3] = XTIME(a0) ^ a0 ^ a1 ^ a2 ^ XTIME(a3);
+        }
+        for (i = 0; i < 16; i++)
+            b[i] ^= rk[16 * r + i];
+    }
+}
+
+/*
+ * cmac_double() - multiply by x in GF(2^128)
+ */
+void cmac_double(
+    unsigned char *out, /* result */
+    unsigned char *in   /* operand */
+)
+{
+    int i;
+
+    for (i = 0; i < 15; i++)
+        out[i] = in[i] << 1 | in[i + 1] >> 7;
+    out[15] = in[15] << 1 ^ (in[0] & 0x80 ? 0x87 : 0);
+}
+
+/*
+ * cmac_init() - expand key into round keys and subkeys
+ */
+int /* TRUE if expanded, FALSE if not a 128-bit key */
+cmac_init(struct key *k /* key */)
+{
+    static const unsigned char rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10,
+                                           0x20, 0x40, 0x80, 0x1b, 0x36};
+    unsigned char l[16], t[4], u;
+    int i;
+
+    if (k->len != 16)
+        return (FALSE);
+
+    memcpy(k->rk, k->key, 16);
+    for (i = 4; i < 44; i++)
+    {
+        memcpy(t, &k->rk[4 * (i - 1)], 4);
+        if (i % 4 == 0)
+        {
+            u = t[0];
+            t[0] = sbox[t[1]] ^ rcon[i / 4 - 1];
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[u];
+        }
+        k->rk[4 * i] = k->rk[4 * (i - 4)] ^ t[0];
+        k->rk[4 * i + 1] = k->rk[4 * (i - 4) + 1] ^ t[1];
+        k->rk[4 * i + 2] = k->rk[4 * (i - 4) + 2] ^ t[2];
+        k->rk[4 * i + 3] = k->rk[4 * (i - 4) + 3] ^ t[3];
+    }
+
+    memset(l, 0, sizeof(l));
+    aes_block(k, l);
+    cmac_double(k->k1, l);
+    cmac_double(k->k2, k->k1);
+    return (TRUE);
+}
+
+/*
+ * cmac_last() - make last block of message
+ *
+ * A whole last block is masked with K1; a short or empty one is
+ * padded with a one bit and zeros and masked with K2.
+ */
+static int /* number of blocks */
+cmac_last(
+    struct mjob *j,    /* job */
+    unsigned char *out /* last block (returned) */
+)
+{
+    unsigned char *mask;
+    int n, r, i;
+
+    n = (j->len + 15) / 16;
+    if (n == 0)
+        n = 1;
+    r = j->len - 16 * (n - 1);
+    memcpy(out, j->buf + 16 * (n - 1), r);
+    if (r == 16)
+    {
+        mask = j->k->k1;
+    }
+    else
+    {
+        out[r] = 0x80;
+        memset(out + r + 1, 0, 15 - r);
+        mask = j->k->k2;
+    }
+    for (i = 0; i < 16; i++)
+        out[i] ^= mask[i];
+    return (n);
+}
+
+/*
+ * cmac_soft() - compute tag without AES-NI
+ */
+static void cmac_soft(struct mjob *j /* job */)
+{
+    unsigned char x[16], last[16];
+    int n, b, i;
+
+    n = cmac_last(j, last);
+    memset(x, 0, sizeof(x));
+    for (b = 0; b < n; b++)
+    {
+        for (i = 0; i < 16; i++)
+            x[i] ^= b < n - 1 ? j->buf[16 * b + i] : last[i];
+        aes_encrypt(j->k->rk, x);
+    }
+    memcpy(j->d.d, x, 16);
+}
+
+#ifdef __x86_64__
+/*
+ * cmac_stage() - lay the messages out block by block across lanes
+ *
+ * Every lane runs every block.  A lane with fewer blocks than the
+ * others has its tag taken after its own last block and goes on
+ * encrypting zeros.
+ */
+static int /* most blocks in any lane */
+cmac_stage(
+    struct mjob **jp,               /* jobs */
+    int nl,                         /* jobs used */
+    int width,                      /* lanes */
+    unsigned char (*m)[NCLANE][16], /* blocks by lane (returned) */
+    int *nblk                       /* blocks per lane (returned) */
+)
+{
+    int maxn, l, b;
+
+    maxn = 1;
+    for (l = 0; l < width; l++)
+    {
+        if (l >= nl)
+        {
+            nblk[l] = 0;
+            continue;
+        }
+        nblk[l] = cmac_last(jp[l], m[0][l]);
+        if (nblk[l] > 1)
+        {
+            memcpy(m[nblk[l] - 1][l], m[0][l], 16);
+            for (b = 0; b < nblk[l] - 1; b++)
+                memcpy(m[b][l], jp[l]->buf + 16 * b, 16);
+        }
+        maxn = max(maxn, nblk[l]);
+    }
+    for (l = 0; l < width; l++)
+    {
+        for (b = nblk[l]; b < maxn; b++)
+            memset(m[b][l], 0, 16);
+    }
+    return (maxn);
+}
+
+/*
+ * aes_ni() - encrypt one block in place with AES-NI
+ */
+__attribute__((target("aes,sse2"))) static void aes_ni(
+    unsigned char *rk, /* round keys */
+    unsigned char *b   /* block */
+)
+{
+    __m128i x;
+    int i;
+
+    x = _mm_xor_si128(_mm_loadu_si128((__m128i *)b),
+                      _mm_loadu_si128((__m128i *)rk));
+    for (i = 1; i < 10; i++)
+        x = _mm_aesenc_si128(x, _mm_loadu_si128((__m128i *)(rk + 16 * i)));
+    x = _mm_aesenclast_si128(x, _mm_loadu_si128((__m128i *)(rk + 160)));
+    _mm_storeu_si128((__m128i *)b, x);
+}
+
+/*
+ * cmac_one() - compute one tag with AES-NI
+ *
+ * A lone message has nothing to interleave with, so it chains its
+ * blocks straight from the buffer rather than staging them.
+ */
+__attribute__((target("aes,sse2"))) static void cmac_one(
+    struct mjob *j /* job */
+)
+{
+    unsigned char last[16], *m;
+    __m128i rk[11], x;
+    int n, b, i;
+
+    n = cmac_last(j, last);
+    for (i = 0; i < 11; i++)
+        rk[i] = _mm_loadu_si128((__m128i *)(j->k->rk + 16 * i));
+    x = _mm_setzero_si128();
+    for (b = 0; b < n; b++)
+    {
+        m = b < n - 1 ? j->buf + 16 * b : last;
+        x = _mm_xor_si128(x, _mm_xor_si128(_mm_loadu_si128((__m128i *)m),
+                                           rk[0]));
+        for (i = 1; i < 10; i++)
+            x = _mm_aesenc_si128(x, rk[i]);
+        x = _mm_aesenclast_si128(x, rk[10]);
+    }
+    _mm_storeu_si128((__m128i *)j->d.d, x);
+}
+
+/*
+ * cmac_ni() - compute up to four tags with AES-NI
+ */
+__attribute__((target("aes,sse2"))) static void cmac_ni(
+    struct mjob **jp, /* jobs */
+    int nl            /* number of jobs, at most NNLANE */
+)
+{
+    unsigned char m[MAXCBLK][NCLANE][16];
+    __m128i rk[NNLANE][11], x[NNLANE];
+    int nblk[NCLANE];
+    int maxn, b, l, i;
+
+    maxn = cmac_stage(jp, nl, NNLANE, m, nblk);
+    for (l = 0; l < NNLANE; l++)
+    {
+        for (i = 0; i < 11; i++)
+            rk[l][i] = _mm_loadu_si128(
+                (__m128i *)(jp[l < nl ? l : 0]->k->rk + 16 * i));
+        x[l] = _mm_setzero_si128();
+    }
+
+    /*
+     * The lane loops have a constant count and are unrolled, so the
+     * four chains run interleaved.
+     */
+    for (b = 0; b < maxn; b++)
+    {
+        for (l = 0; l < NNLANE; l++)
+            x[l] = _mm_xor_si128(x[l], _mm_xor_si128(
+                                           _mm_loadu_si128((__m128i *)m[b][l]),
+                                           rk[l][0]));
+        for (i = 1; i < 10; i++)
+        {
+            for (l = 0; l < NNLANE; l++)
+                x[l] = _mm_aesenc_si128(x[l], rk[l][i]);
+        }
+        for (l = 0; l < NNLANE; l++)
+            x[l] = _mm_aesenclast_si128(x[l], rk[l][10]);
+
+        for (l = 0; l < nl; l++)
+        {
+            if (nblk[l] == b + 1)
+                _mm_storeu_si128((__m128i *)jp[l]->d.d, x[l]);
+        }
+    }
+}
+
+/*
+ * cmac_vaes() - compute up to eight tags with VAES
+ */
+__attribute__((target("vaes,avx512f,aes"))) static void cmac_vaes(
+    struct mjob **jp, /* jobs */
+    int nl            /* number of jobs, at most NCLANE */
+)
+{
+    unsigned char m[MAXCBLK][NCLANE][16];
+    unsigned char rkb[11][NCLANE][16]; /* round keys by lane */
+    unsigned char out[NCLANE][16];     /* chaining values by lane */
+    __m512i rk[2][11], x[2];
+    int nblk[NCLANE];
+    int maxn, b, l, i, g;
+
+    maxn = cmac_stage(jp, nl, NCLANE, m, nblk);
+    for (l = 0; l < NCLANE; l++)
+    {
+        for (i = 0; i < 11; i++)
+            memcpy(rkb[i][l], jp[l < nl ? l : 0]->k->rk + 16 * i, 16);
+    }
+    for (g = 0; g < 2; g++)
+    {
+        for (i = 0; i < 11; i++)
+            rk[g][i] = _mm512_loadu_si512(rkb[i][4 * g]);
+        x[g] = _mm512_setzero_si512();
+    }
+
+    for (b = 0; b < maxn; b++)
+    {
+        for (g = 0; g < 2; g++)
+            x[g] = _mm512_xor_si512(x[g], _mm512_xor_si512(
+                                              _mm512_loadu_si512(m[b][4 * g]),
+                                              rk[g][0]));
+        for (i = 1; i < 10; i++)
+        {
+            for (g = 0; g < 2; g++)
+                x[g] = _mm512_aesenc_epi128(x[g], rk[g][i]);
+        }
+        for (g = 0; g < 2; g++)
+            x[g] = _mm512_aesenclast_epi128(x[g], rk[g][10]);
+
+        for (l = 0; l < nl; l++)
+        {
+            if (nblk[l] != b + 1)
+                continue;
+
+            _mm512_storeu_si512(out[4 * (l / 4)], x[l / 4]);
+            memcpy(jp[l]->d.d, out[l], 16);
+        }
+    }
+}
+#endif
+
+/*
+ * aes_block() - encrypt one block in place
+ */
+void aes_block(
+    struct key *k,   /* key */
+    unsigned char *b /* block */
+)
+{
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("aes"))
+    {
+        aes_ni(k->rk, b);
+        return;
+    }
+#endif
+    aes_encrypt(k->rk, b);
+}
+
+/*
+ * cmac_digest() - compute tag
+ */
+void cmac_digest(
+    struct key *k,      /* key */
+    unsigned char *buf, /* header and extension fields */
+    int len,            /* length (octets) */
+    digest *dgst        /* tag (returned) */
+)
+{
+    struct mjob j, *jp;
+
+    j.k = k;
+    j.buf = buf;
+    j.len = len;
+    jp = &j;
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("aes"))
+        cmac_one(jp);
+    else
+#endif
+        cmac_soft(jp);
+    *dgst = j.d;
+}
+
+/*
+ * cmac_batch() - compute the tags of a batch
+ */
+void cmac_batch(
+    struct mjob **jp, /* jobs */
+    int n             /* number of jobs */
+)
+{
+    int i;
+
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f"))
+    {
+        for (i = 0; i < n; i += NCLANE)
+            cmac_vaes(jp + i, min(n - i, NCLANE));
+        return;
+    }
+    if (__builtin_cpu_supports("aes"))
+    {
+        for (i = 0; i < n; i += NNLANE)
+            cmac_ni(jp + i, min(n - i, NNLANE));
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++)
+        cmac_soft(jp[i]);
+}
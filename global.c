@@ -23,15 +23,20 @@
  * multiplication by a constant.
  *
  * The IPv4 address is 32 bits, while the IPv6 address is 128 bits.  The
- * message digest field is 128 bits as constructed by the MD5 algorithm.
- * The precision and poll interval fields are signed log2 seconds.
+ * message digest field is 128 bits, which holds both the MD5 digest and
+ * the AES-128-CMAC tag of RFC 8573.  The precision and poll interval
+ * fields are signed log2 seconds.
  */
 typedef unsigned long long tstamp; /* NTP timestamp format */
 typedef unsigned int tdist;        /* NTP short format */
 typedef unsigned long ipaddr;      /* IPv4 or IPv6 address */
-typedef unsigned long digest;      /* md5 digest */
 typedef signed char s_char;        /* precision and poll interval (log2) */
 
+typedef struct
+{
+  unsigned char d[16]; /* MD5 digest or CMAC tag */
+} digest;
+
 /*
  * Timestamp conversion macroni
  */
@@ -42,14 +47,65 @@ typedef signed char s_char;        /* precision and poll interval (log2) */
 #define FRAC 4294967296.              /* 2^32 as a double */
 #define D2LFP(a) ((tstamp)((a)*FRAC)) /* NTP timestamp */
 #define LFP2D(a) ((double)(a) / FRAC)
-#define U2LFP(a) (((unsigned long long)((a).tv_sec + JAN_1970) << 32) + \
-                  (unsigned long long)((a).tv_usec / 1e6 * FRAC))
+#define JAN_1970 2208988800UL         /* 1970 - 1900 in seconds */
+#define U2LFP(a) (((tstamp)((a).tv_sec + JAN_1970) << 32) + \
+                  us2lfp((a).tv_usec))
+#define N2LFP(a) (((tstamp)((a).tv_sec + JAN_1970) << 32) + \
+                  ns2lfp((a).tv_nsec))
+
+/*
+ * Timestamp arithmetic.  The difference of two timestamps is a signed
+ * 32.32 value, taken modulo 2^64 so that it comes out right across an
+ * era boundary as long as the two are within 68 years of each other.
+ * Differences are taken and combined in fixed point and converted to
+ * double once, at the end.  The fraction conversions are done in
+ * integers; a fraction of microseconds or nanoseconds is rounded up,
+ * so converting it back gives the same count.
+ */
+static inline long long /* a - b */
+lfp_sub(
+    tstamp a, /* timestamp */
+    tstamp b  /* timestamp */
+)
+{
+    return ((long long)(a - b));
+}
+
+static inline double /* seconds */
+lfp_d(long long a /* signed 32.32 */)
+{
+    return (a / FRAC);
+}
+
+static inline long long /* signed 32.32 */
+d_lfp(double a /* seconds */)
+{
+    return ((long long)(a * FRAC));
+}
+
+static inline tstamp /* fraction */
+us2lfp(long us /* microseconds */)
+{
+    return ((((tstamp)us << 32) + 999999) / 1000000);
+}
+
+static inline tstamp /* fraction */
+ns2lfp(long ns /* nanoseconds */)
+{
+    return ((((tstamp)ns << 32) + 999999999) / 1000000000);
+}
+
+static inline long /* microseconds */
+lfp2us(tstamp a /* timestamp, only the fraction is used */)
+{
+    return ((long)(((a & 0xffffffff) * 1000000) >> 32));
+}
 
 /*
  * Arithmetic conversions
  */
 #define LOG2D(a) ((a) < 0 ? 1. / (1L << -(a)) : 1L << (a)) /* poll, etc. */
-#define SQUARE(x) (x * x)
+#define SQUARE(x) ((x) * (x))
 #define SQRT(x) (sqrt(x))
 
 /*
@@ -66,14 +122,26 @@ typedef signed char s_char;        /* precision and poll interval (log2) */
 #define MAXSTRAT 16 /* maximum stratum (infinity metric) */
 #define MINPOLL 6   /* % minimum poll interval (64 s)*/
 #define MAXPOLL 17  /* % maximum poll interval (36.4 h) */
+#define MAXDPOLL 10 /* % maximum discipline poll interval (1024 s) */
 #define MINCLOCK 3  /* minimum manycast survivors */
 #define MAXCLOCK 10 /* maximum manycast candidates */
 #define TTLMAX 8    /* max ttl manycast */
 #define BEACON 15   /* max interval between beacons */
 
+#define PORT 123     /* NTP port */
+#define NBATCH 32    /* % packets per receive/transmit batch */
+#define LEN_PKT 48   /* NTP header length (octets) */
+#define LEN_BUF 1024 /* packet buffer length (octets) */
+
+#define RTABLE 65536 /* rate limit table entries (power of 2) */
+#define RINT 8       /* % average packet interval (s) */
+#define RBURST 8     /* % packet burst */
+#define RKOD 16      /* % kiss-o'-death packets per second */
+
+#define NTSROT 3600 /* % NTS master key rotation interval (s) */
+
 #define PHI 15e-6 /* % frequency tolerance (15 ppm) */
 #define NSTAGE 8  /* clock register stages */
-#define NMAX 50   /* maximum number of peers */
 #define NSANE 1   /* % minimum intersection survivors */
 #define NMIN 3    /* % minimum cluster survivors */
 
@@ -107,13 +175,37 @@ typedef signed char s_char;        /* precision and poll interval (log2) */
 #define P_NOTRUST 0x08 /* authenticated access */
 #define P_NOPEER 0x10  /* authenticated mobilization */
 #define P_MANY 0x20    /* manycast client */
+#define P_XSTAMP 0x40  /* kernel transmit timestamps */
+#define P_XLEAVE 0x80  /* interleaved symmetric mode */
+
+/*
+ * Restrict flags.  The restrict word of an access control list entry
+ * holds these and the P_NOTRUST and P_NOPEER switches; access()
+ * returns it with the rate limit outcome added.  Zero means access
+ * denied.
+ */
+#define R_ACCESS 0x100  /* access granted */
+#define R_NOSERVE 0x200 /* no server replies */
+#define R_LIMIT 0x400   /* apply rate limit */
+#define R_LIMITED 0x800 /* rate limit exceeded */
+#define R_KOD 0x1000    /* send RATE kiss-o'-death */
+#define R_DEFAULT R_ACCESS /* no matching entry */
+
 /*
  * Authentication codes
  */
-#define A_NONE 0   /* no authentication */
-#define A_OK 1     /* authentication OK */
-#define A_ERROR 2  /* authentication error */
-#define A_CRYPTO 3 /* crypto-NAK */
+#define A_NONE 0     /* no authentication */
+#define A_OK 1       /* authentication OK */
+#define A_ERROR 2    /* authentication error */
+#define A_CRYPTO 3   /* crypto-NAK */
+#define A_UNKNOWN -1 /* not yet authenticated */
+
+/*
+ * Key types
+ */
+#define K_MD5 0  /* keyed MD5 */
+#define K_CMAC 1 /* AES-128-CMAC (RFC 8573) */
+#define NKTYPE 2 /* number of key types */
 
 /*
  * Association state codes
@@ -156,38 +248,48 @@ typedef signed char s_char;        /* precision and poll interval (log2) */
 /*
  * The receive and transmit packets may contain an optional message
  * authentication code (MAC) consisting of a key identifier (keyid) and
- * message digest (mac in the receive structure and dgst in the transmit
- * structure).  NTPv4 supports optional extension fields that
- * are inserted after the header and before the MAC, but these are
- * not described here.
+ * message digest (mac in the receive structure; the transmit digest is
+ * computed by encode_packet() over the encoded packet).  NTPv4
+ * supports optional extension fields that are inserted after the
+ * header and before the MAC.  The only ones understood here are those
+ * of Network Time Security (RFC 8915) in server mode; the receive
+ * structure notes where they are and nts_serve() takes them apart.
  *
  * Receive packet
  *
  * Note the dst timestamp is not part of the packet itself.  It is
  * captured upon arrival and returned in the receive buffer along with
  * the buffer length and data.  Note that some of the char fields are
- * packed in the actual header, but the details are omitted here.
+ * packed in the actual header; decode_packet() and encode_packet()
+ * convert between the wire format and these structures.
  */
 struct r
 {
-  ipaddr srcaddr;   /* source (remote) address */
-  ipaddr dstaddr;   /* destination (local) address */
-  char version;     /* version number */
-  char leap;        /* leap indicator */
-  char mode;        /* mode */
-  char stratum;     /* stratum */
-  char poll;        /* poll interval */
-  s_char precision; /* precision */
-  tdist rootdelay;  /* root delay */
-  tdist rootdisp;   /* root dispersion */
-  char refid;       /* reference ID */
-  tstamp reftime;   /* reference time */
-  tstamp org;       /* origin timestamp */
-  tstamp rec;       /* receive timestamp */
-  tstamp xmt;       /* transmit timestamp */
-  int keyid;        /* key ID */
-  digest mac;       /* message digest */
-  tstamp dst;       /* destination timestamp */
+  ipaddr srcaddr;     /* source (remote) address */
+  ipaddr dstaddr;     /* destination (local) address */
+  int srcport;        /* source (remote) port */
+  char version;       /* version number */
+  char leap;          /* leap indicator */
+  char mode;          /* mode */
+  char stratum;       /* stratum */
+  char poll;          /* poll interval */
+  s_char precision;   /* precision */
+  tdist rootdelay;    /* root delay */
+  tdist rootdisp;     /* root dispersion */
+  unsigned refid;     /* reference ID */
+  tstamp reftime;     /* reference time */
+  tstamp org;         /* origin timestamp */
+  tstamp rec;         /* receive timestamp */
+  tstamp xmt;         /* transmit timestamp */
+  int maclen;         /* MAC length (octets) */
+  int keyid;          /* key ID */
+  digest mac;         /* message digest */
+  tstamp dst;         /* destination timestamp */
+  unsigned char *pkt; /* packet buffer */
+  int len;            /* length covered by MAC (octets) */
+  int auth;           /* authentication code */
+  int eflen;          /* extension fields length (octets) */
+  struct nts *nts;    /* NTS request or NULL */
 } r;
 
 /*
@@ -195,25 +297,76 @@ struct r
  */
 struct x
 {
-  ipaddr dstaddr;   /* source (local) address */
-  ipaddr srcaddr;   /* destination (remote) address */
-  char version;     /* version number */
-  char leap;        /* leap indicator */
-  char mode;        /* mode */
-  char stratum;     /* stratum */
-  char poll;        /* poll interval */
-  s_char precision; /* precision */
-  tdist rootdelay;  /* root delay */
-  tdist rootdisp;   /* root dispersion */
-  char refid;       /* reference ID */
-  tstamp reftime;   /* reference time */
-  tstamp org;       /* origin timestamp */
-  tstamp rec;       /* receive timestamp */
-  tstamp xmt;       /* transmit timestamp */
-  int keyid;        /* key ID */
-  digest dgst;      /* message digest */
+  ipaddr dstaddr;     /* source (local) address */
+  ipaddr srcaddr;     /* destination (remote) address */
+  int dstport;        /* destination (remote) port */
+  char version;       /* version number */
+  char leap;          /* leap indicator */
+  char mode;          /* mode */
+  char stratum;       /* stratum */
+  char poll;          /* poll interval */
+  s_char precision;   /* precision */
+  tdist rootdelay;    /* root delay */
+  tdist rootdisp;     /* root dispersion */
+  unsigned refid;     /* reference ID */
+  tstamp reftime;     /* reference time */
+  tstamp org;         /* origin timestamp */
+  tstamp rec;         /* receive timestamp */
+  tstamp xmt;         /* transmit timestamp */
+  int maclen;         /* MAC length (octets) */
+  int keyid;          /* key ID */
+  int stamp;          /* TRUE to ask when it left */
+  unsigned char *hdr; /* header template or NULL */
+  struct nts *nts;    /* NTS request answered or NULL */
 } x;
 
+/*
+ * NTS request.  nts_serve() fills it in on the stack from a client
+ * request, and encode_header() answers it with the extension fields
+ * of the reply.
+ */
+#define NCOOKIE 8 /* most cookies in a reply */
+
+struct nts
+{
+  unsigned char *uid;    /* unique identifier */
+  int uidlen;            /* unique identifier length (octets) */
+  unsigned char c2s[32]; /* client-to-server key */
+  unsigned char s2c[32]; /* server-to-client key */
+  int ncookie;           /* cookies to send */
+  int nak;               /* send NTS NAK */
+};
+
+/*
+ * Key structure.  The CMAC keys carry the AES round keys and the two
+ * CMAC subkeys, expanded once when the key is added to the key store.
+ */
+#define LEN_KEY 32 /* maximum key length (octets) */
+
+struct key
+{
+  int keyid;                  /* key identifier */
+  int type;                   /* key type */
+  int len;                    /* key length (octets) */
+  int trusted;                /* TRUE if trusted */
+  unsigned char key[LEN_KEY]; /* key */
+  unsigned char rk[176];      /* AES round keys */
+  unsigned char k1[16];       /* CMAC subkey for whole last block */
+  unsigned char k2[16];       /* CMAC subkey for padded last block */
+};
+
+/*
+ * MAC job.  The batch routines compute a digest for each of a vector
+ * of these.
+ */
+struct mjob
+{
+  struct key *k;      /* key */
+  unsigned char *buf; /* message */
+  int len;            /* message length (octets) */
+  digest d;           /* digest (returned) */
+};
+
 /*
  * A.1.3 Association Data Structures
  */
@@ -247,32 +400,35 @@ struct p
   char hmode;     /* host mode */
   int keyid;      /* key identifier */
   int flags;      /* option flags */
+  struct p *next; /* next association */
+  struct p *prev; /* previous association */
 
   /*
    * Variables set by received packet
    */
   char leap;            /* leap indicator */
   char pmode;           /* peer mode */
-  char stratum;         /* stratum */
   char ppoll;           /* peer poll interval */
-  double rootdelay;     /* root delay */
-  double rootdisp;      /* root dispersion */
-  char refid;           /* reference ID */
+  unsigned refid;       /* reference ID */
   tstamp reftime;       /* reference time */
 #define begin_clear org /* beginning of clear area */
   tstamp org;           /* originate timestamp */
   tstamp rec;           /* receive timestamp */
   tstamp xmt;           /* transmit timestamp */
+  tstamp prec;          /* peer receive timestamp */
+  tstamp porg;          /* our transmit timestamp it answers */
+  tstamp xrec;          /* previous peer receive timestamp */
+  tstamp xdst;          /* previous receive timestamp */
+  tstamp xorg;          /* previous one it answered */
+  int xleave;           /* TRUE if last sent interleaved */
 
   /*
-   * Computed data
+   * Computed data.  What the selection algorithms read is in the hot
+   * table.
    */
-  double t;           /* update time */
+  int h;              /* hot table entry */
   struct f f[NSTAGE]; /* clock filter */
-  double offset;      /* peer offset */
-  double delay;       /* peer delay */
-  double disp;        /* peer dispersion */
-  double jitter;      /* RMS jitter */
+  int fnext;          /* next filter stage */
 
   /*
    * Poll process variables
@@ -285,8 +441,41 @@ struct p
   int unreach;            /* unreach counter */
   int outdate;            /* last poll time */
   int nextdate;           /* next poll time */
+  struct p *tnext;        /* next on timer wheel */
+  struct p **tprev;       /* link to this on timer wheel */
 } p;
 
+struct p *assoc; /* association list */
+
+/*
+ * Hot association table.  The association variables that clock
+ * selection, clustering and combining read are kept here in parallel
+ * arrays, apart from the configuration and packet state, so those
+ * algorithms scan them with unit stride rather than take a cache miss
+ * on each association.  The entries are dense: when an association
+ * goes, the last entry moves into its place.  p->h is the entry of
+ * association p and hot.p[] leads back.
+ */
+#define NOEPOCH (~0ULL) /* root distance out of date */
+
+struct hot
+{
+  double *t;         /* update time */
+  double *offset;    /* peer offset */
+  double *delay;     /* peer delay */
+  double *disp;      /* peer dispersion */
+  double *jitter;    /* RMS jitter */
+  double *rootdelay; /* root delay */
+  double *rootdisp;  /* root dispersion */
+  double *dist;      /* root distance */
+  tstamp *distt;     /* process time of root distance */
+  char *stratum;     /* stratum */
+  char *fit;         /* fit at the last selection */
+  struct p **p;      /* association */
+  int n;             /* entries */
+  int size;          /* entries allocated */
+} hot;
+
 /*
  * A.1.4 System Data Structures
  */
@@ -308,6 +497,9 @@ struct v
 {
   struct p *p;   /* peer structure pointer */
   double metric; /* sort metric */
+  double dist;   /* root distance */
+  double offset; /* offset */
+  double sum;    /* sum of squared offset differences */
 } v;
 
 /*
@@ -315,30 +507,58 @@ struct v
  */
 struct s
 {
-  tstamp t;         /* update time */
-  char leap;        /* leap indicator */
-  char stratum;     /* stratum */
-  char poll;        /* poll interval */
-  char precision;   /* precision */
-  double rootdelay; /* root delay */
-  double rootdisp;  /* root dispersion */
-  char refid;       /* reference ID */
-  tstamp reftime;   /* reference time */
-  struct m m[NMAX]; /* chime list */
-  struct v v[NMAX]; /* survivor list */
-  struct p *p;      /* association ID */
-  double offset;    /* combined offset */
-  double jitter;    /* combined jitter */
-  int flags;        /* option flags */
-  int n;            /* number of survivors */
+  tstamp t;                   /* update time */
+  char leap;                  /* leap indicator */
+  char stratum;               /* stratum */
+  char poll;                  /* poll interval */
+  char precision;             /* precision */
+  double rootdelay;           /* root delay */
+  double rootdisp;            /* root dispersion */
+  unsigned refid;             /* reference ID */
+  tstamp reftime;             /* reference time */
+  struct m *m;                /* chime list, then sort scratch */
+  struct v *v;                /* survivor list */
+  int *w;                     /* intersection sweep */
+  int nlist;                  /* list room (associations) */
+  struct p *p;                /* association ID */
+  double offset;              /* combined offset */
+  double jitter;              /* combined jitter */
+  int flags;                  /* option flags */
+  int n;                      /* number of survivors */
+  tstamp selt;                /* process time of last selection */
+  int pending;                /* selection put off */
+  unsigned int seq;           /* update sequence (odd while writing) */
+  unsigned char hdr[LEN_PKT]; /* reply header template */
 } s;
 
+/*
+ * Server worker threads read the system variables in s without taking
+ * a lock.  The system process brackets every update of the variables
+ * sent in reply packets with S_BEGIN() and S_END(), so a reader can
+ * tell it raced with an update and try again.  S_END() also rebuilds
+ * the header template in s.hdr from the new values, so the reply path
+ * only has to copy it.
+ */
+#define S_BEGIN()                                                 \
+  do                                                              \
+  {                                                               \
+    __atomic_store_n(&s.seq, s.seq + 1, __ATOMIC_RELAXED);        \
+    __atomic_thread_fence(__ATOMIC_RELEASE);                      \
+  } while (0)
+#define S_END()                                                   \
+  do                                                              \
+  {                                                               \
+    encode_system(s.hdr);                                         \
+    __atomic_store_n(&s.seq, s.seq + 1, __ATOMIC_RELEASE);        \
+  } while (0)
+
 /*
  * A.1.5 Local Clock Data Structures
  */
 struct c
 {
   tstamp t;      /* update time */
+  double epoch;  /* time of last discipline update */
   int state;     /* current state */
   double offset; /* current offset */
   double last;   /* previous offset */
@@ -348,6 +568,19 @@ struct c
   double wander; /* RMS wander */
 } c;
 
+/*
+ * Association pool statistics, as returned by pool_stat()
+ */
+struct pool
+{
+  int slabs; /* slabs mapped */
+  int huge;  /* slabs on huge pages */
+  int total; /* slots in slabs */
+  int used;  /* slots in use */
+  int peak;  /* most slots in use */
+  int fails; /* allocations refused */
+};
+
 /*
  * A.1.6 Function Prototypes
  */
@@ -356,6 +589,7 @@ struct c
  * Peer process
  */
 void receive(struct r *);                              /* receive packet */
+void serve(struct r *);                                /* serve client packet */
 void packet(struct p *, struct r *);                   /* process packet */
 void clock_filter(struct p *, double, double, double); /* filter */
 double root_dist(struct p *);                          /* calculate root distance */
@@ -370,6 +604,8 @@ int main();                    /* main program */
 void clock_select();           /* find the best clocks */
 void clock_update(struct p *); /* update the system clock */
 void clock_combine();          /* combine the offsets */
+int sel_reserve(int);          /* make room in the lists */
+void handoff(struct r *);      /* pass packet to system process */
 
 /*
  * Local clock process
@@ -388,19 +624,79 @@ void poll(struct p *);                /* poll process */
 void poll_update(struct p *, int);    /* update the poll interval */
 void peer_xmit(struct p *);           /* transmit a packet */
 void fast_xmit(struct r *, int, int); /* transmit a reply packet */
+void timer_arm(struct p *);           /* schedule the next poll */
+void timer_cancel(struct p *);        /* cancel the next poll */
+void timer_run(unsigned int);         /* poll the associations due */
+void kod_xmit(struct r *, char *);    /* transmit a kiss-o'-death */
 
 /*
  * Utility routines
  */
-digest md5(int);                                        /* generate a message digest */
+int mac(int, unsigned char *, int, digest *);           /* generate a message digest */
+void mac_batch(struct mjob *, int);                     /* generate digests of a batch */
+void mac_check(struct r *, int);                        /* check MACs of a batch */
 struct p *mobilize(ipaddr, ipaddr, int, int, int, int); /* mobilize */
 struct p *find_assoc(struct r *);                       /* search the association table */
+void unlink_assoc(struct p *);                          /* remove from the association table */
+void free_assoc(struct p *);                            /* return association memory */
+void pool_stat(struct pool *);                          /* association pool statistics */
+int decode_packet(struct r *, unsigned char *, int);    /* decode received packet */
+int encode_header(struct x *, unsigned char *);         /* encode all but the digest */
+int encode_packet(struct x *, unsigned char *);         /* encode transmit packet */
+void encode_system(unsigned char *);                    /* encode header template */
+int acl_add(ipaddr, int, int);                          /* add restrict line */
+int acl_compile();                                      /* build access control lists */
+int acl_lookup(ipaddr);                                 /* find restrict word */
+void acl_reclaim();                                     /* free retired ACL tables */
+int rate_init();                                        /* key rate limit table */
+int key_add(int, int, unsigned char *, int, int);       /* add key to next key set */
+int key_commit();                                       /* publish next key set */
+struct key *key_lookup(int);                            /* find key */
+void key_quiesce();                                     /* holding no key pointers */
+void key_reclaim();                                     /* free retired key sets */
+unsigned long key_retire();                             /* start reader generation */
+unsigned long key_seen();                               /* generation all readers saw */
+
+/*
+ * Keyed hash
+ */
+unsigned long long sip_hash(unsigned long long *, unsigned long long,
+                            unsigned long long, int); /* SipHash-2-4 */
+
+/*
+ * MAC types
+ */
+void md5_digest(struct key *, unsigned char *, int, digest *);  /* MD5 digest */
+void md5_batch(struct mjob **, int);                            /* MD5 digests of a batch */
+int cmac_init(struct key *);                                    /* expand CMAC key */
+void cmac_digest(struct key *, unsigned char *, int, digest *); /* CMAC tag */
+void cmac_batch(struct mjob **, int);                           /* CMAC tags of a batch */
+void cmac_double(unsigned char *, unsigned char *);             /* multiply by x */
+void aes_block(struct key *, unsigned char *);                  /* encrypt one block */
+
+/*
+ * Network Time Security
+ */
+void nts_init();                                                    /* make first master key */
+void nts_rotate();                                                  /* make new master key */
+int nts_ke(unsigned char *, unsigned char *, unsigned char *, int); /* make cookies */
+int nts_serve(struct r *);                                          /* answer NTS request */
+int nts_encode(struct nts *, unsigned char *);                      /* encode reply fields */
 
 /*
  * Kernel interface
  */
+int io_open(ipaddr, int);     /* open socket */
 struct r *recv_packet();      /* wait for packet */
+int recv_batch(struct r **);  /* wait for batch of packets */
 void xmit_packet(struct x *); /* send packet */
+void xmit_flush();            /* send queued packets */
+tstamp xmit_stamp(tstamp);    /* kernel transmit timestamp */
+void uring_run(int);          /* io_uring receive loop */
+int uring_xmit(struct x *);   /* send packet on the ring */
+void xdp_run(char *, int);    /* AF_XDP receive loop */
+int xdp_xmit(struct x *);     /* send reply on AF_XDP socket */
+void sim_run();               /* simulation loop */
 void step_time(double);       /* step time */
 void adjust_time(double);     /* adjust (slew) time */
 tstamp get_time();
\ No newline at end of file
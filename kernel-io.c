@@ -1,14 +1,338 @@
+#define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+#include "global.c";
+#include <endian.h>           /* for htobe64() */
+#include <linux/errqueue.h>   /* for scm_timestamping */
+#include <linux/net_tstamp.h> /* for SOF_TIMESTAMPING_* */
+#include <netinet/in.h>       /* for sockaddr_in */
+#include <sys/socket.h>       /* for recvmmsg(), sendmmsg() and friends */
+
 /*
  * Kernel interface to transmit and receive packets. Details are
  * deliberately vague and depend on the operating system.
  *
+ * Packets are moved in batches of up to NBATCH at a time, using the
+ * Linux recvmmsg() and sendmmsg() system calls.  A server answering
+ * client requests pays one system call for a whole vector of requests
+ * and one more for the whole vector of replies, rather than one for
+ * each packet in either direction.  The xmit_packet() routine only
+ * queues the packet; the queue is flushed by xmit_flush() when full,
+ * after each receive batch has been processed and after each run of
+ * the poll process.  The MAC digests of the queued packets are
+ * computed together by mac_batch() just before the flush.
+ *
+ * The receive timestamp is struck by the kernel as the packet arrives
+ * (SO_TIMESTAMPNS) and returned in a control message, so the time
+ * spent queued in the socket and waiting for the scheduler does not
+ * end up in the offset and delay.  If the control message is missing,
+ * the packet is stamped on return from the system call instead.
+ *
+ * For packets sent by associations with P_XSTAMP or P_XLEAVE, the
+ * kernel also reports the time the packet actually left
+ * (SO_TIMESTAMPING).  The report comes back through the socket error
+ * queue together with the packet, which is matched by its transmit
+ * timestamp against a small log of such packets.  packet() uses
+ * xmit_stamp() to look up when the request a reply answers left, and
+ * peer_xmit() to send an interleaved peer the departure time of the
+ * previous packet.  Nothing else asks for reports, so
+ * server replies cost nothing extra.  A report counts against the
+ * socket receive buffer until it is read, so the error queue is
+ * drained after each transmit batch and before each receive batch,
+ * but only while some logged packet is still waiting for its report.
+ * A thread that sends no such packets never reads it.
+ *
+ * In the multi-worker server mode every thread opens its own socket
+ * on the NTP port with SO_REUSEPORT and the kernel spreads arriving
+ * packets across them.  The socket and batch state are therefore kept
+ * per thread.
+ */
+#define RCVTIMEO 100000 /* worker receive timeout (us) */
+#define NTXLOG 64       /* transmit log entries */
+#define LEN_CTL CMSG_SPACE(sizeof(struct timespec)) /* control length */
+#define LEN_TSCTL CMSG_SPACE(sizeof(unsigned int))  /* request length */
+#define LEN_ERRCTL 256  /* error queue control length */
+
+static __thread int sock = -1; /* socket descriptor */
+static __thread ipaddr laddr;  /* local address */
+
+/*
+ * Receive batch.  The r structures are returned to the caller, which
+ * owns them until the next call of recv_batch().
+ */
+static __thread unsigned char rbuf[NBATCH][LEN_BUF]; /* receive buffers */
+static __thread unsigned char rctl[NBATCH][LEN_CTL]; /* control buffers */
+static __thread struct sockaddr_in rname[NBATCH];    /* source addresses */
+static __thread struct iovec riov[NBATCH];           /* receive vectors */
+static __thread struct mmsghdr rmsg[NBATCH];         /* receive headers */
+static __thread struct r rpkt[NBATCH];               /* receive packets */
+static __thread int rnext, rcount;                   /* recv_packet() cursor */
+
+/*
+ * Transmit queue
+ */
+static __thread unsigned char tbuf[NBATCH][LEN_BUF]; /* transmit buffers */
+static __thread struct sockaddr_in tname[NBATCH];    /* destination addresses */
+static __thread struct iovec tiov[NBATCH];           /* transmit vectors */
+static __thread struct mmsghdr tmsg[NBATCH];         /* transmit headers */
+static __thread unsigned char tctl[NBATCH][LEN_TSCTL]; /* timestamp requests */
+static __thread tstamp txmt[NBATCH];                 /* transmit timestamps */
+static __thread struct mjob tjob[NBATCH];            /* MACs to compute */
+static __thread int tjmsg[NBATCH];                   /* packet of each MAC */
+static __thread int tcount, tjobs;                   /* queued packets, MACs */
+
+/*
+ * Transmit log of the packets that asked for kernel transmit
+ * timestamps.  It is used round robin.
+ */
+struct txlog
+{
+    tstamp xmt;  /* transmit timestamp in packet */
+    tstamp dxmt; /* kernel transmit timestamp */
+};
+static __thread struct txlog tlog[NTXLOG]; /* transmit log */
+static __thread int tnext;                 /* next log entry */
+static __thread int tpend;                 /* entries awaiting report */
+
+/*
+ * io_open - open the NTP socket
+ */
+int /* socket descriptor or -1 */
+io_open(
+    ipaddr addr, /* local address */
+    int reuse    /* share the port with other threads */
+)
+{
+    struct sockaddr_in sin;
+    struct cmsghdr *cmsg;
+    struct timeval tv;
+    int on = 1;
+    int ts;
+    int i;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return (-1);
+
+    /*
+     * A shared socket must not block forever, since the system
+     * process also has to pick up the packets handed to it by the
+     * workers.
+     */
+    if (reuse)
+    {
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on,
+                       sizeof(on)) < 0)
+            return (-1);
+
+        tv.tv_sec = 0;
+        tv.tv_usec = RCVTIMEO;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(PORT);
+    sin.sin_addr.s_addr = addr;
+    if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        return (-1);
+
+    /*
+     * Ask for kernel receive timestamps.  Failure is not fatal; the
+     * packets are then stamped in user space.
+     */
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    /*
+     * Have the kernel report software transmit timestamps.  Which
+     * packets get one is decided packet by packet in xmit_packet().
+     */
+    ts = SOF_TIMESTAMPING_SOFTWARE;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &ts, sizeof(ts));
+
+    laddr = addr;
+
+    /*
+     * The message headers point at fixed buffers, so they are set up
+     * once here and only the lengths change from batch to batch.
+     */
+    for (i = 0; i < NBATCH; i++)
+    {
+        riov[i].iov_base = rbuf[i];
+        riov[i].iov_len = LEN_BUF;
+        rmsg[i].msg_hdr.msg_name = &rname[i];
+        rmsg[i].msg_hdr.msg_iov = &riov[i];
+        rmsg[i].msg_hdr.msg_iovlen = 1;
+        rmsg[i].msg_hdr.msg_control = rctl[i];
+
+        tiov[i].iov_base = tbuf[i];
+        tmsg[i].msg_hdr.msg_name = &tname[i];
+        tmsg[i].msg_hdr.msg_namelen = sizeof(tname[i]);
+        tmsg[i].msg_hdr.msg_iov = &tiov[i];
+        tmsg[i].msg_hdr.msg_iovlen = 1;
+
+        cmsg = (struct cmsghdr *)tctl[i];
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SO_TIMESTAMPING;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned int));
+        ts = SOF_TIMESTAMPING_TX_SOFTWARE;
+        memcpy(CMSG_DATA(cmsg), &ts, sizeof(ts));
+    }
+    return (sock);
+}
+
+/*
+ * recv_stamp - extract kernel receive timestamp from control message
+ */
+static tstamp /* NTP timestamp or 0 */
+recv_stamp(struct msghdr *msg /* message header pointer */)
+{
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (N2LFP(ts));
+        }
+    }
+    return (0);
+}
+
+/*
+ * xmit_drain - read kernel transmit timestamps into the transmit log
+ */
+static void
+xmit_drain()
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct scm_timestamping tss;
+    unsigned char buf[LEN_BUF];
+    unsigned char ctl[LEN_ERRCTL];
+    tstamp dxmt, key;
+    int len, i;
+
+    /*
+     * The packet comes back with its network headers, so the
+     * transmit timestamp field is found by searching for it.
+     */
+    while (tpend > 0)
+    {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+        len = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (len < 0)
+            break;
+
+        dxmt = 0;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPING)
+            {
+                memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+                dxmt = N2LFP(tss.ts[0]);
+            }
+        }
+        if (dxmt == 0)
+            continue;
+
+        for (i = 0; i < NTXLOG; i++)
+        {
+            key = htobe64(tlog[i].xmt);
+            if (tlog[i].xmt != 0 && tlog[i].dxmt == 0 &&
+                memmem(buf, len, &key, sizeof(key)) != NULL)
+            {
+                tlog[i].dxmt = dxmt;
+                tpend--;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * recv_batch - receive a batch of packets from network
+ *
+ * Wait for at least one packet, then return as many as are queued in
+ * the kernel, up to NBATCH.
+ */
+int /* number of packets */
+recv_batch(struct r **rv /* receive vector pointer */)
+{
+    tstamp now = 0; /* fallback receive timestamp */
+    int n, m, i;
+
+    for (i = 0; i < NBATCH; i++)
+    {
+        rmsg[i].msg_hdr.msg_namelen = sizeof(rname[i]);
+        rmsg[i].msg_hdr.msg_controllen = LEN_CTL;
+    }
+    xmit_drain();
+    n = recvmmsg(sock, rmsg, NBATCH, MSG_WAITFORONE, NULL);
+    if (n < 0)
+        n = 0;
+
+    /*
+     * Packets with format errors are dropped here, so the vector
+     * returned holds valid packets only.
+     */
+    m = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (!decode_packet(&rpkt[m], rbuf[i], rmsg[i].msg_len))
+            continue;
+
+        rpkt[m].srcaddr = rname[i].sin_addr.s_addr;
+        rpkt[m].srcport = ntohs(rname[i].sin_port);
+        rpkt[m].dstaddr = laddr;
+
+        /*
+         * Strike the receive timestamp.  The fallback is read at
+         * most once per batch.
+         */
+        rpkt[m].dst = recv_stamp(&rmsg[i].msg_hdr);
+        if (rpkt[m].dst == 0)
+        {
+            if (now == 0)
+                now = get_time();
+            rpkt[m].dst = now;
+        }
+        m++;
+    }
+    *rv = rpkt;
+    return (m);
+}
+
+/*
  * recv_packet - receive packet from network
+ *
+ * Hand out the packets of the current batch one at a time.  When it
+ * is used up, flush any replies before waiting for the next one.
  */
 struct r /* receive packet pointer*/
     *
     recv_packet()
 {
-    return (/* receive packet r */ 0);
+    struct r *rv;
+
+    while (rnext >= rcount)
+    {
+        xmit_flush();
+        rcount = recv_batch(&rv);
+        rnext = 0;
+    }
+    return (&rpkt[rnext++]);
 }
 
 /*
@@ -16,5 +340,111 @@ struct r /* receive packet pointer*/
  */
 void xmit_packet(struct x *x /* transmit packet pointer */)
 {
-    /* send packet x */
+#ifdef URING
+    if (uring_xmit(x))
+        return; /* queued on the ring */
+#endif
+#ifdef XDP
+    if (xdp_xmit(x))
+        return; /* sent in the request frame */
+#endif
+    if (tcount >= NBATCH)
+        xmit_flush();
+
+    memset(&tname[tcount], 0, sizeof(tname[tcount]));
+    tname[tcount].sin_family = AF_INET;
+    tname[tcount].sin_port = htons(x->dstport);
+    tname[tcount].sin_addr.s_addr = x->dstaddr;
+    tiov[tcount].iov_len = encode_header(x, tbuf[tcount]);
+    txmt[tcount] = x->xmt;
+    if (x->maclen == sizeof(digest) + 4)
+    {
+        tjob[tjobs].k = key_lookup(x->keyid);
+        if (tjob[tjobs].k == NULL || !tjob[tjobs].k->trusted)
+        {
+            memset(tbuf[tcount] + LEN_PKT + 4, 0, sizeof(digest));
+        }
+        else
+        {
+            tjob[tjobs].buf = tbuf[tcount];
+            tjob[tjobs].len = LEN_PKT;
+            tjmsg[tjobs++] = tcount;
+        }
+    }
+    if (!x->stamp)
+    {
+        tmsg[tcount].msg_hdr.msg_control = NULL;
+        tmsg[tcount].msg_hdr.msg_controllen = 0;
+    }
+    else
+    {
+        tmsg[tcount].msg_hdr.msg_control = tctl[tcount];
+        tmsg[tcount].msg_hdr.msg_controllen = LEN_TSCTL;
+    }
+    tcount++;
+}
+
+/*
+ * xmit_flush - send all queued packets
+ */
+void xmit_flush()
+{
+    int i, n;
+
+    mac_batch(tjob, tjobs);
+    for (i = 0; i < tjobs; i++)
+        memcpy(tbuf[tjmsg[i]] + LEN_PKT + 4, &tjob[i].d, sizeof(digest));
+    tjobs = 0;
+
+    /*
+     * The kernel might accept only part of the vector.  Keep going
+     * with the remainder until it is all sent or an error occurs, in
+     * which case the rest is dropped as any lost datagram would be.
+     */
+    for (i = 0; i < tcount; i += n)
+    {
+        n = sendmmsg(sock, &tmsg[i], tcount - i, 0);
+        if (n <= 0)
+            break;
+    }
+
+    /*
+     * Log the packets that went out and asked for a timestamp.  An
+     * entry still waiting when its turn comes round again has lost
+     * its report and is waited for no longer.
+     */
+    for (n = 0; n < i; n++)
+    {
+        if (tmsg[n].msg_hdr.msg_control == NULL)
+            continue;
+
+        if (tlog[tnext].xmt == 0 || tlog[tnext].dxmt != 0)
+            tpend++;
+        tlog[tnext].xmt = txmt[n];
+        tlog[tnext].dxmt = 0;
+        tnext = (tnext + 1) % NTXLOG;
+    }
+    tcount = 0;
+    xmit_drain();
+}
+
+/*
+ * xmit_stamp - look up kernel transmit timestamp
+ *
+ * First drain the socket error queue of the kernel transmit
+ * timestamps into the transmit log, then find the packet that was
+ * sent with transmit timestamp xmt.
+ */
+tstamp /* NTP timestamp or 0 if not known */
+xmit_stamp(tstamp xmt /* transmit timestamp in packet */)
+{
+    int i;
+
+    xmit_drain();
+    for (i = 0; i < NTXLOG; i++)
+    {
+        if (tlog[i].xmt == xmt)
+            return (tlog[i].dxmt);
+    }
+    return (0);
 }
\ No newline at end of file
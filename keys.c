@@ -0,0 +1,247 @@
+#include "global.c";
+
+/*
+ * Symmetric key store, the local key cache of the specification.  The
+ * keys live in an open addressing table keyed on the key ID, so a
+ * lookup is a hash, a load or two and no lock.  Keys are added to the
+ * table, each with its type and whether it is trusted; an untrusted
+ * key is known but does not authenticate anything.
+ *
+ * To change the keys, key_add() collects the whole new set and
+ * key_commit() builds it into a fresh table and publishes it with one
+ * pointer store.  Readers never wait: they see the old table or the
+ * new one, whole.  This replaces the keys without disturbing the
+ * associations, so there is no need to restart to rotate a key.
+ *
+ * The old table is freed once every reader thread has passed a
+ * quiescent state since it was replaced.  Readers announce one by
+ * calling key_quiesce() between batches, when they hold no key
+ * pointers.  They record the generation they have seen and the table
+ * retired in a later generation waits on them.  A thread blocked for
+ * packets holds up freeing until its receive times out or the
+ * one-second timer runs, which is soon enough; key_reclaim() runs from
+ * clock_adjust() and tries again.  The access control tables are
+ * swapped the same way and retired through the same generations, so a
+ * quiescent reader holds no table pointers of either kind.
+ */
+#define NREADER 64 /* most reader threads */
+
+/*
+ * Key table.  A slot with key ID 0 is empty, key ID 0 meaning no key
+ * in NTP.
+ */
+struct kstore
+{
+  unsigned int mask;   /* slots - 1 */
+  int shift;           /* hash shift */
+  unsigned long gen;   /* generation it was retired in */
+  struct kstore *next; /* next retired table */
+  struct key key[];    /* slots */
+};
+
+static struct kstore *kstore;        /* published table */
+static struct kstore *kretired;      /* tables waiting to be freed */
+static struct key *klist;            /* keys for the next table */
+static int nklist, maxklist;         /* keys used, allocated */
+static unsigned long kgen = 1;       /* generation */
+static unsigned long kseen[NREADER]; /* generation seen by reader */
+static int nreader;                  /* readers registered */
+static __thread int kme = -1;        /* this reader */
+
+/*
+ * key_hash() - hash key ID into a slot
+ */
+static unsigned int /* slot */
+key_hash(
+    struct kstore *ks, /* table */
+    int keyid          /* key identifier */
+)
+{
+    return (((unsigned int)keyid * 2654435769U) >> ks->shift);
+}
+
+/*
+ * key_add() - add key to the next table
+ */
+int /* TRUE if added, FALSE if not */
+key_add(
+    int keyid,          /* key identifier */
+    int type,           /* key type */
+    unsigned char *key, /* key */
+    int len,            /* key length */
+    int trusted         /* TRUE if trusted */
+)
+{
+    struct key *k;
+
+    if (keyid == 0 || type < 0 || type >= NKTYPE || len > LEN_KEY)
+        return (FALSE);
+
+    if (type == K_CMAC && len != 16)
+        return (FALSE);
+
+    if (nklist == maxklist)
+    {
+        k = realloc(klist, (maxklist + 64) * sizeof(struct key));
+        if (k == NULL)
+            return (FALSE);
+
+        klist = k;
+        maxklist += 64;
+    }
+    k = &klist[nklist++];
+    memset(k, 0, sizeof(struct key));
+    k->keyid = keyid;
+    k->type = type;
+    k->len = len;
+    k->trusted = trusted;
+    memcpy(k->key, key, len);
+    if (type == K_CMAC)
+        cmac_init(k);
+    return (TRUE);
+}
+
+/*
+ * key_retire() - start a generation for a table just replaced
+ */
+unsigned long /* generation to free it after */
+key_retire()
+{
+    return (__atomic_add_fetch(&kgen, 1, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * key_seen() - find the generation every reader has reached
+ */
+unsigned long /* oldest generation seen, 0 if not known */
+key_seen()
+{
+    unsigned long seen;
+    int i, n;
+
+    /*
+     * A reader past NREADER cannot be followed, so nothing is seen.
+     */
+    seen = __atomic_load_n(&kgen, __ATOMIC_SEQ_CST);
+    n = __atomic_load_n(&nreader, __ATOMIC_ACQUIRE);
+    if (n > NREADER)
+        return (0);
+
+    for (i = 0; i < n; i++)
+        seen = min(seen, __atomic_load_n(&kseen[i], __ATOMIC_ACQUIRE));
+    return (seen);
+}
+
+/*
+ * key_reclaim() - free the retired tables no reader can see
+ */
+void key_reclaim()
+{
+    struct kstore *ks, **kp;
+    unsigned long seen;
+
+    seen = key_seen();
+    for (kp = &kretired; (ks = *kp) != NULL;)
+    {
+        if (ks->gen <= seen)
+        {
+            *kp = ks->next;
+            free(ks);
+        }
+        else
+        {
+            kp = &ks->next;
+        }
+    }
+}
+
+/*
+ * key_commit() - publish the keys added since the last commit
+ *
+ * The key set replaces the old one entirely, so keys left out are
+ * gone.
+ */
+int /* TRUE if published, FALSE if out of memory */
+key_commit()
+{
+    struct kstore *ks, *old;
+    struct key *k;
+    unsigned int size, i;
+    int bits;
+
+    /*
+     * At most half full, so probe runs stay short.
+     */
+    for (bits = 4; 1U << bits < 2U * nklist; bits++)
+        ;
+    size = 1U << bits;
+    ks = calloc(1, sizeof(struct kstore) + size * sizeof(struct key));
+    if (ks == NULL)
+        return (FALSE);
+
+    ks->mask = size - 1;
+    ks->shift = 32 - bits;
+    for (k = klist; k < klist + nklist; k++)
+    {
+        for (i = key_hash(ks, k->keyid);; i = (i + 1) & ks->mask)
+        {
+            if (ks->key[i].keyid == 0 || ks->key[i].keyid == k->keyid)
+                break;
+        }
+        ks->key[i] = *k;
+    }
+    nklist = 0;
+
+    /*
+     * Publish, then retire the old table in the generation after,
+     * which readers reach only once they can no longer see it.
+     */
+    old = __atomic_exchange_n(&kstore, ks, __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        old->gen = key_retire();
+        old->next = kretired;
+        kretired = old;
+    }
+    key_reclaim();
+    return (TRUE);
+}
+
+/*
+ * key_lookup() - find key
+ */
+struct key * /* key or NULL */
+key_lookup(int keyid /* key identifier */)
+{
+    struct kstore *ks;
+    struct key *k;
+    unsigned int i;
+
+    ks = __atomic_load_n(&kstore, __ATOMIC_ACQUIRE);
+    if (ks == NULL || keyid == 0)
+        return (NULL);
+
+    for (i = key_hash(ks, keyid);; i = (i + 1) & ks->mask)
+    {
+        k = &ks->key[i];
+        if (k->keyid == keyid)
+            return (k);
+        if (k->keyid == 0)
+            return (NULL);
+    }
+}
+
+/*
+ * key_quiesce() - note that this thread holds no key or ACL pointers
+ *
+ * A thread is registered on its first call, which must come before
+ * its first lookup.
+ */
+void key_quiesce()
+{
+    if (kme < 0)
+        kme = __atomic_fetch_add(&nreader, 1, __ATOMIC_ACQ_REL);
+    if (kme < NREADER)
+        __atomic_store_n(&kseen[kme], __atomic_load_n(&kgen, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+}
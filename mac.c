@@ -0,0 +1,151 @@
+#include "global.c";
+
+/*
+ * Message authentication codes.  The key type picks the MAC: keyed
+ * MD5, or AES-128-CMAC as in RFC 8573.  Both give a 128-bit digest in
+ * the same place in the packet, so the rest of the program sees only
+ * the key ID.  Each type provides a routine for one message and one
+ * for a batch, listed in the mtype table; a new type is a new row.
+ *
+ * mac() is used by the transmit path and by authenticate() for
+ * packets that did not come in a batch.  mac_check() checks a whole
+ * receive batch and mac_batch() computes the digests for a transmit
+ * batch; both hand each type its messages in one vector.
+ *
+ * The keys come from the key store.  An untrusted key authenticates
+ * nothing, here or on the way out.
+ */
+
+/*
+ * MAC type
+ */
+struct mtype
+{
+  void (*digest)(struct key *, unsigned char *, int, digest *); /* one */
+  void (*batch)(struct mjob **, int);                           /* many */
+};
+
+static const struct mtype mtype[NKTYPE] = {
+    [K_MD5] = {md5_digest, md5_batch},
+    [K_CMAC] = {cmac_digest, cmac_batch},
+};
+
+/*
+ * mac() - compute message digest
+ */
+int /* TRUE if computed, FALSE if no trusted key */
+mac(
+    int keyid,          /* key identifier */
+    unsigned char *buf, /* header and extension fields */
+    int len,            /* length (octets) */
+    digest *dgst        /* message digest (returned) */
+)
+{
+    struct key *k;
+
+    /*
+     * Compute a keyed cryptographic message digest.  The key
+     * identifier is associated with a key in the local key cache.
+     * The key is prepended to the packet header and extension fields
+     * and the result hashed by the MD5 algorithm as described in
+     * RFC 1321, or the header and extension fields are run through
+     * AES-128-CMAC under the key as described in RFC 8573.
+     */
+    k = key_lookup(keyid);
+    if (k == NULL || !k->trusted || len > LEN_BUF)
+        return (FALSE);
+
+    mtype[k->type].digest(k, buf, len, dgst);
+    return (TRUE);
+}
+
+/*
+ * mac_batch() - compute the message digests of a batch
+ */
+void mac_batch(
+    struct mjob *jv, /* jobs */
+    int n            /* number of jobs */
+)
+{
+    struct mjob *jp[NKTYPE][NBATCH];
+    int nj[NKTYPE];
+    int i, t;
+
+    /*
+     * Sort the jobs by key type, NBATCH at a time, and give each
+     * type its share in one call.
+     */
+    while (n > 0)
+    {
+        memset(nj, 0, sizeof(nj));
+        for (i = 0; i < min(n, NBATCH); i++)
+        {
+            t = jv[i].k->type;
+            jp[t][nj[t]++] = &jv[i];
+        }
+        for (t = 0; t < NKTYPE; t++)
+        {
+            if (nj[t] > 0)
+                mtype[t].batch(jp[t], nj[t]);
+        }
+        jv += i;
+        n -= i;
+    }
+}
+
+/*
+ * mac_check() - check the MACs of a batch of receive packets
+ */
+void mac_check(
+    struct r *rv, /* receive packets */
+    int n         /* number of packets */
+)
+{
+    struct mjob jv[NBATCH];
+    struct r *rp[NBATCH];
+    struct key *k;
+    struct r *r;
+    int nj, i;
+
+    /*
+     * Packets without a full MAC need no digest, and neither does
+     * one with an unknown key.
+     */
+    while (n > 0)
+    {
+        nj = 0;
+        for (r = rv; r < rv + min(n, NBATCH); r++)
+        {
+            if (r->maclen == 0)
+            {
+                r->auth = A_NONE;
+                continue;
+            }
+            if (r->maclen == 4)
+            {
+                r->auth = A_CRYPTO;
+                continue;
+            }
+            k = key_lookup(r->keyid);
+            if (k == NULL || !k->trusted || r->len > LEN_BUF)
+            {
+                r->auth = A_ERROR;
+                continue;
+            }
+            jv[nj].k = k;
+            jv[nj].buf = r->pkt;
+            jv[nj].len = r->len;
+            rp[nj++] = r;
+        }
+        mac_batch(jv, nj);
+        for (i = 0; i < nj; i++)
+        {
+            if (memcmp(&jv[i].d, &rp[i]->mac, sizeof(digest)) == 0)
+                rp[i]->auth = A_OK;
+            else
+                rp[i]->auth = A_ERROR;
+        }
+        rv = r;
+        n -= min(n, NBATCH);
+    }
+}
@@ -1,5 +1,9 @@
 
 #include "global.c";
+#include <pthread.h>    /* for pthread_create() and friends */
+#include <stdio.h>      /* for perror() */
+#include <sys/mman.h>   /* for mmap() */
+#include <sys/random.h> /* for getrandom() */
 
 /*
  * Definitions
@@ -8,6 +12,62 @@
 #define IPADDR 0      /* any IP address */
 #define MODE 0        /* any NTP mode */
 #define KEYID 0       /* any key identifier */
+#define KEY NULL      /* any key */
+#define WORKERS 0     /* server worker threads (0 for none) */
+#define NHAND 256     /* handoff queue length */
+#define XDPDEV "eth0" /* AF_XDP interface */
+
+/*
+ * Handoff queue.  Packets received by the server worker threads that
+ * need the association table are queued here for the system process.
+ * This is only for the occasional non-client packet, so a lock is
+ * good enough.
+ */
+struct r hq[NHAND];                                /* queued packets */
+unsigned char hbuf[NHAND][LEN_BUF];                /* queued packet buffers */
+int hhead, htail;                                  /* queue pointers */
+pthread_mutex_t hlock = PTHREAD_MUTEX_INITIALIZER; /* queue lock */
+
+/*
+ * Association index.  An open addressing table with linear probing,
+ * keyed on source address, destination address and mode, points to
+ * the associations in the association list.  The key is hashed with
+ * SipHash-1-3 under a random key drawn at startup, so a remote host
+ * cannot aim for long probe sequences.  Each slot keeps the full hash,
+ * so a probe touches the association itself only on a real match.
+ * The table is at most half full and doubles when it would be more.
+ */
+#define NASSOC 64 /* initial index slots (power of 2) */
+
+struct aslot
+{
+  unsigned long long h; /* key hash */
+  struct p *p;          /* association or NULL */
+};
+
+struct aslot *atab;         /* index slots */
+unsigned int amask;         /* slots - 1 */
+int acount;                 /* associations */
+unsigned long long akey[2]; /* hash key */
+
+/*
+ * Association pool.  Associations come from slabs of SLAB octets
+ * mapped straight from the kernel, on huge pages when there are any.
+ * Each slot is rounded up to a multiple of the cache line, so no two
+ * associations share a line.  Free slots are chained through their
+ * next pointers, so allocation and release are O(1) and never touch
+ * malloc().  Slabs are never given back; at most MAXSLAB are mapped,
+ * which bounds the memory a flood of ephemeral associations can take.
+ */
+#define SLAB (2 << 20) /* slab size (one huge page) */
+#define MAXSLAB 32     /* % maximum slabs */
+#define LINE 64        /* cache line size (octets) */
+#define PSIZE ((sizeof(struct p) + LINE - 1) / LINE * LINE) /* slot size */
+
+struct pool pool; /* pool statistics */
+struct p *pfree;  /* free slots */
+
+void *worker(void *); /* server worker thread */
 
 /*
  * main() - main program
@@ -15,7 +75,11 @@
 int main()
 {
     struct p *p; /* peer structure pointer */
-    struct r *r; /* receive packet pointer */
+    struct r *r;                  /* receive packet vector */
+    struct r rh;                  /* handed off packet */
+    unsigned char rhbuf[LEN_BUF]; /* handed off packet buffer */
+    pthread_t tid;                /* worker thread ID */
+    int n, i;
     /*
      * Read command line options and initialize system variables.
      * The reference implementation measures the precision specific
@@ -28,6 +92,7 @@ int main()
     s.poll = MINPOLL;
     s.precision = PRECISION;
     s.p = NULL;
+    encode_system(s.hdr);
 
     /*
      * Initialize local clock variables
@@ -55,21 +120,469 @@ int main()
                      P_FLAGS);
     }
 
+    /*
+     * Likewise add the restrict lines with address, prefix length
+     * and restrict word, then build the access control lists.
+     */
+    while (/* restrict lines */ 0)
+        acl_add(IPADDR, 0, R_DEFAULT);
+    acl_compile();
+    nts_init();
+    if (!rate_init())
+        exit(1);
+
+    /*
+     * And the keys, with key ID, type, key and whether trusted.  The
+     * same two steps on a reload replace the keys in service.
+     */
+    while (/* keys file lines */ 0)
+        key_add(KEYID, K_MD5, KEY, 0, TRUE);
+    key_commit();
+
     /*
      * Start the system timer, which ticks once per second.  Then,
-     * read packets as they arrive, strike receive timestamp, and
-     * call the receive() routine.
+     * read packets as they arrive and call the receive() routine.
+     * The receive timestamp has already been struck by the kernel.
+     * Packets arrive in batches; the replies queued by receive() go
+     * out together once the batch is done.
+     *
+     * In the multi-worker server mode, the system process shares
+     * the NTP port with WORKERS - 1 worker threads, each with its
+     * own socket.  Besides its own packets, it picks up those handed
+     * to it by the workers.
      */
+    n = io_open(IPADDR, WORKERS > 0);
+    if (n < 0)
+    {
+        perror("NTP socket");
+        exit(1);
+    }
+#ifdef URING
+    /*
+     * The io_uring engine runs the receive loop and the one-second
+     * timer in a single ring on this thread, so there are no worker
+     * threads with it.  It returns only if the ring cannot be set up,
+     * and then the kernel loop below takes over.
+     */
+#if WORKERS > 0
+#error "URING has no worker threads; set WORKERS to 0"
+#endif
+    uring_run(n);
+#endif
+#ifdef XDP
+    /*
+     * The AF_XDP engine serves the NTP queue of the interface and runs
+     * the one-second timer.  The socket is kept for everything else
+     * sent.  It does not return.
+     */
+    xdp_run(XDPDEV, 0);
+#endif
+#ifdef SIM
+    /*
+     * The simulator stands in for the network and the system clock
+     * and runs the protocol in simulated time.  It does not return.
+     */
+    sim_run();
+#endif
+    for (i = 1; i < WORKERS; i++)
+        pthread_create(&tid, NULL, worker, NULL);
     while (0)
     {
-        r = recv_packet();
-        r->dst = get_time();
-        receive(r);
+        key_quiesce();
+        n = recv_batch(&r);
+        mac_check(r, n);
+        for (i = 0; i < n; i++)
+            receive(&r[i]);
+
+        pthread_mutex_lock(&hlock);
+        while (htail != hhead)
+        {
+            rh = hq[htail];
+            rh.pkt = rhbuf;
+            memcpy(rhbuf, hbuf[htail], rh.len + rh.maclen);
+            htail = (htail + 1) % NHAND;
+            pthread_mutex_unlock(&hlock);
+            receive(&rh);
+            pthread_mutex_lock(&hlock);
+        }
+        pthread_mutex_unlock(&hlock);
+        xmit_flush();
     }
 
     return (0);
 }
 
+/*
+ * worker() - server worker thread
+ */
+void *
+worker(void *arg /* not used */)
+{
+    struct r *r; /* receive packet vector */
+    int n, i;
+
+    (void)arg;
+
+    /*
+     * Each worker has its own socket on the NTP port and answers
+     * client packets on its own with serve().
+     */
+    if (io_open(IPADDR, TRUE) < 0)
+        return (NULL);
+
+    while (1)
+    {
+        key_quiesce();
+        n = recv_batch(&r);
+        mac_check(r, n);
+        for (i = 0; i < n; i++)
+            serve(&r[i]);
+        xmit_flush();
+    }
+}
+
+/*
+ * handoff() - queue packet for the system process
+ */
+void handoff(struct r *r /* receive packet pointer */)
+{
+    /*
+     * If the queue is full, the packet is dropped.  The packet
+     * buffer belongs to the worker, so the packet goes along.
+     */
+    pthread_mutex_lock(&hlock);
+    if ((hhead + 1) % NHAND != htail)
+    {
+        hq[hhead] = *r;
+        hq[hhead].pkt = hbuf[hhead];
+        memcpy(hbuf[hhead], r->pkt, r->len + r->maclen);
+        hhead = (hhead + 1) % NHAND;
+    }
+    pthread_mutex_unlock(&hlock);
+}
+
+/*
+ * sip_hash() - SipHash-2-4 of a message of up to 15 octets
+ *
+ * The message is one word of eight octets, then the rest in the low
+ * octets of the tail.
+ */
+unsigned long long /* hash */
+sip_hash(
+    unsigned long long *key, /* key (two words) */
+    unsigned long long m,    /* first eight octets */
+    unsigned long long tail, /* rest of the message */
+    int len                  /* message length (octets) */
+)
+{
+    unsigned long long v0, v1, v2, v3;
+    int i;
+
+#define ROTL(x, b) ((x) << (b) | (x) >> (64 - (b)))
+#define SIPROUND                         \
+    do                                   \
+    {                                    \
+        v0 += v1;                        \
+        v1 = ROTL(v1, 13);               \
+        v1 ^= v0;                        \
+        v0 = ROTL(v0, 32);               \
+        v2 += v3;                        \
+        v3 = ROTL(v3, 16);               \
+        v3 ^= v2;                        \
+        v0 += v3;                        \
+        v3 = ROTL(v3, 21);               \
+        v3 ^= v0;                        \
+        v2 += v1;                        \
+        v1 = ROTL(v1, 17);               \
+        v1 ^= v2;                        \
+        v2 = ROTL(v2, 32);               \
+    } while (0)
+
+    v0 = key[0] ^ 0x736f6d6570736575ULL;
+    v1 = key[1] ^ 0x646f72616e646f6dULL;
+    v2 = key[0] ^ 0x6c7967656e657261ULL;
+    v3 = key[1] ^ 0x7465646279746573ULL;
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+    m = (unsigned long long)len << 56 | tail;
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+    v2 ^= 0xff;
+    for (i = 0; i < 3; i++)
+        SIPROUND;
+    return (v0 ^ v1 ^ v2 ^ v3);
+#undef SIPROUND
+#undef ROTL
+}
+
+/*
+ * assoc_hash() - hash association key
+ *
+ * The key is 12 octets: both addresses in one word, then the mode.
+ */
+static unsigned long long /* hash */
+assoc_hash(
+    ipaddr srcaddr, /* IP source address */
+    ipaddr dstaddr, /* IP destination address */
+    int mode        /* mode */
+)
+{
+    return (sip_hash(akey,
+                     (unsigned long long)(unsigned int)srcaddr << 32 |
+                         (unsigned int)dstaddr,
+                     mode & 0xff, 12));
+}
+
+/*
+ * assoc_slot() - put association in index slot
+ */
+static void assoc_slot(
+    struct aslot *tab,    /* index slots */
+    unsigned int mask,    /* slots - 1 */
+    unsigned long long h, /* key hash */
+    struct p *p           /* peer structure pointer */
+)
+{
+    unsigned int i;
+
+    for (i = h & mask; tab[i].p != NULL; i = (i + 1) & mask)
+        ;
+    tab[i].h = h;
+    tab[i].p = p;
+}
+
+/*
+ * hot_reserve() - make room in the hot table
+ */
+static int /* TRUE if room, FALSE if no memory */
+hot_reserve(int n /* entries */)
+{
+    void *q;
+    int size;
+
+#define HOTGROW(a)                                                \
+  do                                                              \
+  {                                                               \
+    q = realloc(hot.a, size * sizeof(*hot.a));                    \
+    if (q == NULL)                                                \
+      return (FALSE);                                             \
+    hot.a = q;                                                    \
+  } while (0)
+
+    if (n <= hot.size)
+        return (TRUE);
+
+    size = max(n, 2 * hot.size);
+    HOTGROW(t);
+    HOTGROW(offset);
+    HOTGROW(delay);
+    HOTGROW(disp);
+    HOTGROW(jitter);
+    HOTGROW(rootdelay);
+    HOTGROW(rootdisp);
+    HOTGROW(dist);
+    HOTGROW(distt);
+    HOTGROW(stratum);
+    HOTGROW(fit);
+    HOTGROW(p);
+    hot.size = size;
+    return (TRUE);
+#undef HOTGROW
+}
+
+/*
+ * hot_move() - move hot table entry
+ */
+static void hot_move(
+    int to,  /* new entry */
+    int from /* old entry */
+)
+{
+    hot.t[to] = hot.t[from];
+    hot.offset[to] = hot.offset[from];
+    hot.delay[to] = hot.delay[from];
+    hot.disp[to] = hot.disp[from];
+    hot.jitter[to] = hot.jitter[from];
+    hot.rootdelay[to] = hot.rootdelay[from];
+    hot.rootdisp[to] = hot.rootdisp[from];
+    hot.dist[to] = hot.dist[from];
+    hot.distt[to] = hot.distt[from];
+    hot.stratum[to] = hot.stratum[from];
+    hot.fit[to] = hot.fit[from];
+    hot.p[to] = hot.p[from];
+    hot.p[to]->h = to;
+}
+
+/*
+ * link_assoc() - add association to the list, index and hot table
+ */
+static int /* TRUE if added, FALSE if no memory */
+link_assoc(struct p *p /* peer structure pointer */)
+{
+    struct aslot *tab;
+    unsigned int mask, i;
+
+    /*
+     * Draw the hash key along with the first table.  Growing the
+     * table moves every entry to the new one.
+     */
+    if (2 * (acount + 1) > (int)amask + 1 || atab == NULL)
+    {
+        if (atab == NULL)
+        {
+            if (getrandom(akey, sizeof(akey), 0) != sizeof(akey))
+                return (FALSE);
+            mask = NASSOC - 1;
+        }
+        else
+        {
+            mask = 2 * amask + 1;
+        }
+        tab = calloc(mask + 1, sizeof(struct aslot));
+        if (tab == NULL)
+            return (FALSE);
+
+        for (i = 0; atab != NULL && i <= amask; i++)
+        {
+            if (atab[i].p != NULL)
+                assoc_slot(tab, mask, atab[i].h, atab[i].p);
+        }
+        free(atab);
+        atab = tab;
+        amask = mask;
+    }
+    if (!hot_reserve(acount + 1))
+        return (FALSE);
+
+    assoc_slot(atab, amask, assoc_hash(p->srcaddr, p->dstaddr, p->hmode),
+               p);
+    acount++;
+    p->h = hot.n++;
+    hot.p[p->h] = p;
+    hot.rootdelay[p->h] = 0;
+    hot.rootdisp[p->h] = 0;
+    hot.distt[p->h] = NOEPOCH;
+    hot.fit[p->h] = FALSE;
+
+    p->prev = NULL;
+    p->next = assoc;
+    if (assoc != NULL)
+        assoc->prev = p;
+    assoc = p;
+    return (TRUE);
+}
+
+/*
+ * unlink_assoc() - remove association from the list, index and hot
+ * table
+ */
+void unlink_assoc(struct p *p /* peer structure pointer */)
+{
+    unsigned int i, j, k;
+
+    /*
+     * Find the slot, then close the gap by moving back any later
+     * entry of the probe run that may no longer be reachable from
+     * its home slot.
+     */
+    i = assoc_hash(p->srcaddr, p->dstaddr, p->hmode) & amask;
+    while (atab[i].p != p)
+        i = (i + 1) & amask;
+    for (j = (i + 1) & amask; atab[j].p != NULL; j = (j + 1) & amask)
+    {
+        k = atab[j].h & amask;
+        if (((j - k) & amask) >= ((j - i) & amask))
+        {
+            atab[i] = atab[j];
+            i = j;
+        }
+    }
+    atab[i].p = NULL;
+    acount--;
+    if (p->h != --hot.n)
+        hot_move(p->h, hot.n);
+
+    if (p->prev != NULL)
+        p->prev->next = p->next;
+    else
+        assoc = p->next;
+    if (p->next != NULL)
+        p->next->prev = p->prev;
+}
+
+/*
+ * alloc_assoc() - allocate association from the pool
+ */
+static struct p * /* peer structure pointer or NULL */
+alloc_assoc()
+{
+    unsigned char *slab;
+    struct p *p;
+    int i;
+
+    /*
+     * If the free list is empty, map another slab and chain its
+     * slots, trying huge pages first.
+     */
+    if (pfree == NULL)
+    {
+        if (pool.slabs == MAXSLAB)
+        {
+            pool.fails++;
+            return (NULL);
+        }
+        slab = mmap(NULL, SLAB, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED)
+        {
+            pool.huge++;
+        }
+        else
+        {
+            slab = mmap(NULL, SLAB, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED)
+            {
+                pool.fails++;
+                return (NULL);
+            }
+        }
+        for (i = SLAB / PSIZE - 1; i >= 0; i--)
+        {
+            p = (struct p *)(slab + i * PSIZE);
+            p->next = pfree;
+            pfree = p;
+        }
+        pool.slabs++;
+        pool.total += SLAB / PSIZE;
+    }
+    p = pfree;
+    pfree = p->next;
+    pool.used++;
+    pool.peak = max(pool.peak, pool.used);
+    return (p);
+}
+
+/*
+ * free_assoc() - return association to the pool
+ */
+void free_assoc(struct p *p /* peer structure pointer */)
+{
+    p->next = pfree;
+    pfree = p;
+    pool.used--;
+}
+
+/*
+ * pool_stat() - copy out association pool statistics
+ */
+void pool_stat(struct pool *ps /* statistics (returned) */)
+{
+    *ps = pool;
+}
+
 /*
  * mobilize() - mobilize and initialize an association
  */
@@ -87,20 +600,60 @@ struct p
     struct p *p; /* peer process pointer */
 
     /*
-     * Allocate and initialize association memory
+     * Allocate and initialize association memory, then enter it in
+     * the association table.
      */
-    p = malloc(sizeof(struct p));
+    p = alloc_assoc();
+    if (p == NULL)
+        return (NULL);
+
     p->srcaddr = srcaddr;
     p->dstaddr = dstaddr;
     p->version = version;
     p->hmode = mode;
     p->keyid = keyid;
     p->hpoll = MINPOLL;
+    p->tprev = NULL;
+    if (!link_assoc(p))
+    {
+        free_assoc(p);
+        return (NULL);
+    }
+    if (!sel_reserve(acount))
+    {
+        unlink_assoc(p);
+        free_assoc(p);
+        return (NULL);
+    }
     clear(p, X_INIT);
     p->flags = flags;
     return (p);
 }
 
+/*
+ * find_mode() - find the association with given host mode
+ */
+static struct p * /* peer structure pointer or NULL */
+find_mode(
+    struct r *r, /* receive packet pointer */
+    int mode     /* host mode */
+)
+{
+    struct p *p; /* peer structure pointer */
+    unsigned long long h;
+    unsigned int i;
+
+    h = assoc_hash(r->srcaddr, r->dstaddr, mode);
+    for (i = h & amask; atab[i].p != NULL; i = (i + 1) & amask)
+    {
+        p = atab[i].p;
+        if (atab[i].h == h && r->srcaddr == p->srcaddr &&
+            r->dstaddr == p->dstaddr && mode == p->hmode)
+            return (p);
+    }
+    return (NULL);
+}
+
 /*
  * find_assoc() - find a matching association
  */
@@ -110,32 +663,33 @@ struct p /* peer structure pointer or NULL */
         struct r *r /* receive packet pointer */
     )
 {
-    struct p *p; /* dummy peer structure pointer */
+    struct p *p; /* peer structure pointer */
 
     /*
-     * Search association table for matching source
-     * address, source port and mode.
+     * Search association table for matching source address,
+     * destination address and the host mode that takes packets of
+     * this mode: a server packet goes to a client association, a
+     * broadcast packet to a broadcast client and a symmetric packet
+     * to either symmetric mode.  A client packet goes to none; it is
+     * answered without state.
      */
-    while (/* all associations */ 0)
+    if (acount == 0)
+        return (NULL);
+
+    switch (r->mode)
     {
-        if (r->srcaddr == p->srcaddr && r->mode == p->hmode)
-            return (p);
+    case M_SACT:
+        p = find_mode(r, M_SACT);
+        return (p != NULL ? p : find_mode(r, M_PASV));
+
+    case M_PASV:
+        return (find_mode(r, M_SACT));
+
+    case M_SERV:
+        return (find_mode(r, M_CLNT));
+
+    case M_BCST:
+        return (find_mode(r, M_BCLN));
     }
     return (NULL);
 }
-
-/*
- * md5() - compute message digest
- */
-digest md5(int keyid /* key identifier */)
-{
-    /*
-     * Compute a keyed cryptographic message digest.  The key
-     * identifier is associated with a key in the local key cache.
-     * The key is prepended to the packet header and extension fields
-     * and the result hashed by the MD5 algorithm as described in
-     * RFC 1321.  Return a MAC consisting of the 32-bit key ID
-     * concatenated with the 128-bit digest.
-     */
-    return (/* MD5 digest */ 0);
-}
\ No newline at end of file
@@ -0,0 +1,288 @@
+#include "global.c";
+
+/*
+ * Keyed MD5 message authentication.  The MAC digest is the MD5 digest
+ * (RFC 1321) of the key followed by the NTP header and extension
+ * fields.  md5_digest() does one message at a time.  md5_batch() does
+ * a whole vector; it hashes the messages sixteen at a time, one to a
+ * vector lane, with AVX-512 or AVX2 where the machine has them and
+ * plain SSE2 or scalar code where not.
+ */
+#define NLANE 16  /* multi-buffer lanes */
+#define MAXBLK 2  /* multi-buffer blocks per message */
+#define MINLANE 4 /* fewest messages worth the multi-buffer code */
+
+/*
+ * MD5 constants.  T[i] is the integer part of 2^32 * abs(sin(i + 1)).
+ */
+static const unsigned int T[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+
+/*
+ * Shift amounts for each round, and the message word for each step.
+ */
+static const int S[4][4] = {
+    {7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+static const int K[64] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9};
+
+#define ROTL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+/*
+ * The 64 steps, the same for one lane or many.  The round functions
+ * are written with and, or, xor and not only, which work the same on
+ * integers and on vectors.
+ */
+#define MD5_STEPS(a, b, c, d, f, m)                                   \
+    do                                                                \
+    {                                                                 \
+        int i_;                                                       \
+                                                                      \
+        for (i_ = 0; i_ < 64; i_++)                                   \
+        {                                                             \
+            if (i_ < 16)                                              \
+                f = d ^ (b & (c ^ d));                                \
+            else if (i_ < 32)                                         \
+                f = c ^ (d & (b ^ c));                                \
+            else if (i_ < 48)                                         \
+                f = b ^ c ^ d;                                        \
+            else                                                      \
+                f = c ^ (b | ~d);                                     \
+            f += a + T[i_] + m[K[i_]];                                \
+            a = d;                                                    \
+            d = c;                                                    \
+            c = b;                                                    \
+            b += ROTL(f, S[i_ >> 4][i_ & 3]);                         \
+        }                                                             \
+    } while (0)
+
+/*
+ * md5_block() - hash one 64-octet block
+ */
+static void md5_block(
+    unsigned int *h,         /* hash state */
+    const unsigned char *blk /* block */
+)
+{
+    unsigned int m[16], a, b, c, d, f;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        m[i] = blk[4 * i] | blk[4 * i + 1] << 8 | blk[4 * i + 2] << 16 |
+               (unsigned int)blk[4 * i + 3] << 24;
+    a = h[0];
+    b = h[1];
+    c = h[2];
+    d = h[3];
+    MD5_STEPS(a, b, c, d, f, m);
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+/*
+ * md5_pad() - lay out key, message and padding in whole blocks
+ */
+static int /* number of blocks */
+md5_pad(
+    unsigned char *out, /* blocks (returned) */
+    struct key *k,      /* key */
+    unsigned char *buf, /* message */
+    int len             /* message length */
+)
+{
+    unsigned long long bits;
+    int n, i;
+
+    n = k->len + len;
+    memcpy(out, k->key, k->len);
+    memcpy(out + k->len, buf, len);
+    out[n] = 0x80;
+    i = (n + 8) / 64 + 1;
+    memset(out + n + 1, 0, i * 64 - n - 9);
+    bits = (unsigned long long)n * 8;
+    for (n = 0; n < 8; n++)
+        out[i * 64 - 8 + n] = bits >> (8 * n);
+    return (i);
+}
+
+/*
+ * md5_digest() - compute message digest
+ */
+void md5_digest(
+    struct key *k,      /* key */
+    unsigned char *buf, /* header and extension fields */
+    int len,            /* length (octets) */
+    digest *dgst        /* message digest (returned) */
+)
+{
+    unsigned char blk[LEN_KEY + LEN_BUF + 72];
+    unsigned int h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    int n, i;
+
+    n = md5_pad(blk, k, buf, len);
+    for (i = 0; i < n; i++)
+        md5_block(h, blk + 64 * i);
+    for (i = 0; i < 16; i++)
+        dgst->d[i] = h[i / 4] >> (8 * (i % 4));
+}
+
+/*
+ * Multi-buffer hashing.  A vector holds the same state word of
+ * NLANE messages, one per lane, and the steps above run on whole
+ * vectors.  GCC builds the function once for AVX-512 (one register
+ * per vector), once for AVX2 (two registers) and once for plain
+ * x86-64 (four SSE2 registers), and picks one at load time.
+ */
+typedef unsigned int vlane __attribute__((vector_size(4 * NLANE)));
+
+__attribute__((target_clones("avx512f", "avx2", "default"))) static void
+md5_lanes(
+    unsigned int (*m)[16][NLANE], /* message words by block */
+    int *nblk,                    /* blocks per lane */
+    int maxblk,                   /* most blocks in any lane */
+    unsigned int (*out)[NLANE]    /* digest words (returned) */
+)
+{
+    vlane h[4], a, b, c, d, f, w[16];
+    unsigned int save[4][NLANE];
+    int blk, i, j;
+
+    h[0] = (vlane){} + 0x67452301;
+    h[1] = (vlane){} + 0xefcdab89;
+    h[2] = (vlane){} + 0x98badcfe;
+    h[3] = (vlane){} + 0x10325476;
+
+    /*
+     * Every lane runs every block.  A lane with fewer blocks than
+     * the others has its result taken after its own last block and
+     * goes on hashing garbage.
+     */
+    for (blk = 0; blk < maxblk; blk++)
+    {
+        memcpy(w, m[blk], sizeof(w));
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        MD5_STEPS(a, b, c, d, f, w);
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+
+        memcpy(save, h, sizeof(save));
+        for (i = 0; i < NLANE; i++)
+        {
+            if (nblk[i] != blk + 1)
+                continue;
+
+            for (j = 0; j < 4; j++)
+                out[j][i] = save[j][i];
+        }
+    }
+}
+
+/*
+ * md5_flush() - hash the messages waiting in the lanes
+ */
+static void md5_flush(
+    struct mjob **lane,           /* jobs by lane */
+    int nl,                       /* lanes used */
+    unsigned int (*m)[16][NLANE], /* message words by block */
+    int *nblk,                    /* blocks per lane */
+    int maxblk                    /* most blocks in any lane */
+)
+{
+    unsigned int out[4][NLANE];
+    int i, j;
+
+    /*
+     * A few messages are cheaper one at a time.
+     */
+    if (nl < MINLANE)
+    {
+        for (i = 0; i < nl; i++)
+            md5_digest(lane[i]->k, lane[i]->buf, lane[i]->len, &lane[i]->d);
+        return;
+    }
+
+    for (i = nl; i < NLANE; i++)
+        nblk[i] = 0;
+    md5_lanes(m, nblk, maxblk, out);
+    for (i = 0; i < nl; i++)
+    {
+        for (j = 0; j < 16; j++)
+            lane[i]->d.d[j] = out[j / 4][i] >> (8 * (j % 4));
+    }
+}
+
+/*
+ * md5_batch() - compute the message digests of a batch
+ */
+void md5_batch(
+    struct mjob **jp, /* jobs */
+    int n             /* number of jobs */
+)
+{
+    unsigned char blk[MAXBLK * 64];
+    unsigned int m[MAXBLK][16][NLANE];
+    struct mjob *lane[NLANE];
+    int nblk[NLANE];
+    struct mjob *j;
+    int nl, maxblk, b, i, k, w;
+
+    /*
+     * Long messages go to md5_digest() one at a time; the rest fill
+     * the lanes.
+     */
+    nl = 0;
+    maxblk = 0;
+    for (i = 0; i < n; i++)
+    {
+        j = jp[i];
+        if (j->k->len + j->len + 9 > MAXBLK * 64)
+        {
+            md5_digest(j->k, j->buf, j->len, &j->d);
+            continue;
+        }
+
+        /*
+         * Lay the padded message out one word per lane.
+         */
+        nblk[nl] = md5_pad(blk, j->k, j->buf, j->len);
+        for (b = 0; b < nblk[nl]; b++)
+        {
+            for (k = 0; k < 16; k++)
+            {
+                w = 64 * b + 4 * k;
+                m[b][k][nl] = blk[w] | blk[w + 1] << 8 | blk[w + 2] << 16 |
+                              (unsigned int)blk[w + 3] << 24;
+            }
+        }
+        maxblk = max(maxblk, nblk[nl]);
+        lane[nl++] = j;
+        if (nl == NLANE)
+        {
+            md5_flush(lane, nl, m, nblk, maxblk);
+            nl = 0;
+            maxblk = 0;
+        }
+    }
+    if (nl > 0)
+        md5_flush(lane, nl, m, nblk, maxblk);
+}
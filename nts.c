@@ -0,0 +1,539 @@
+#include "global.c";
+#include <endian.h>     /* for be16toh() and friends */
+#include <sys/random.h> /* for getrandom() */
+
+/*
+ * Network Time Security (RFC 8915), server side.  A client first runs
+ * NTS key establishment (NTS-KE) over TLS, which leaves both ends with
+ * a client-to-server (C2S) and a server-to-client (S2C) key and gives
+ * the client a handful of cookies.  Each NTP request then carries
+ * these extension fields:
+ *
+ * Unique Identifier      random; echoed in the reply
+ * NTS Cookie             one cookie, used once
+ * NTS Cookie Placeholder one per extra cookie wanted back
+ * NTS Authenticator      AEAD tag over everything before it, last
+ *
+ * A cookie is the two keys sealed under a server master key, so the
+ * server keeps no state per client: it opens the cookie, checks the
+ * request with C2S and seals fresh cookies for the reply with S2C.
+ * The master keys are rotated every NTSROT seconds and the last
+ * NMASTER of them are kept, so a cookie stays good for a few hours.
+ *
+ * The AEAD is AES-SIV-CMAC-256 (RFC 5297), the one every NTS
+ * implementation has, built on the CMAC and AES block routines in
+ * cmac.c.  Everything happens in buffers on the stack or in the packet
+ * itself; nothing is allocated per packet.
+ *
+ * NTS-KE itself is a TLS server on its own port and is not in this
+ * program.  It exports the two keys from the TLS session and calls
+ * nts_ke() for the cookies; a local stand-in can do the same with keys
+ * of its own.
+ */
+#define NMASTER 8      /* master keys kept */
+#define LEN_NONCE 16   /* nonce length (octets) */
+#define LEN_SIVKEY 32  /* AES-SIV-CMAC-256 key length (octets) */
+#define LEN_PLAIN 64   /* cookie plaintext, C2S and S2C (octets) */
+#define LEN_COOKIE 100 /* cookie: key ID, nonce, IV, ciphertext */
+#define LEN_UID 32     /* shortest unique identifier (octets) */
+
+/*
+ * Extension field types
+ */
+#define EF_UID 0x0104    /* unique identifier */
+#define EF_COOKIE 0x0204 /* NTS cookie */
+#define EF_HOLDER 0x0304 /* NTS cookie placeholder */
+#define EF_AUTH 0x0404   /* NTS authenticator and encrypted fields */
+
+/*
+ * AES-SIV key, split into its CMAC and CTR halves
+ */
+struct siv
+{
+  struct key mac; /* S2V key */
+  struct key ctr; /* CTR key */
+};
+
+/*
+ * Master key
+ */
+struct master
+{
+  unsigned int id; /* key ID, first in the cookie */
+  struct siv k;    /* key */
+};
+
+static struct master master[NMASTER]; /* master keys */
+static int mcur;                      /* current master key */
+
+/*
+ * Nonce generator, per thread.  AES in counter mode under a random
+ * key, so a nonce costs one block encryption and no system call.
+ */
+static __thread struct key nkey;            /* generator key */
+static __thread unsigned long long nctr[2]; /* generator counter */
+
+/*
+ * nts_seed() - seed nonce generator of this thread
+ */
+static int /* TRUE if seeded, FALSE if no randomness */
+nts_seed()
+{
+    if (nkey.len != 0)
+        return (TRUE);
+
+    if (getrandom(nkey.key, 16, 0) != 16 ||
+        getrandom(nctr, sizeof(nctr), 0) != sizeof(nctr))
+        return (FALSE);
+
+    nkey.len = 16;
+    cmac_init(&nkey);
+    return (TRUE);
+}
+
+/*
+ * nts_nonce() - make random nonce, once the generator is seeded
+ */
+static void nts_nonce(unsigned char *out /* nonce (returned) */)
+{
+    nctr[1]++;
+    memcpy(out, nctr, LEN_NONCE);
+    aes_block(&nkey, out);
+}
+
+/*
+ * siv_init() - expand AES-SIV-CMAC-256 key
+ */
+static void siv_init(
+    struct siv *k,     /* expanded key (returned) */
+    unsigned char *key /* key */
+)
+{
+    k->mac.len = 16;
+    memcpy(k->mac.key, key, 16);
+    cmac_init(&k->mac);
+    k->ctr.len = 16;
+    memcpy(k->ctr.key, key + 16, 16);
+    cmac_init(&k->ctr);
+}
+
+/*
+ * siv_s2v() - compute synthetic IV
+ *
+ * The associated data and the nonce come as up to two vectors; the
+ * plaintext is last.
+ */
+static void siv_s2v(
+    struct siv *k,      /* key */
+    unsigned char **ad, /* associated data and nonce */
+    int *adlen,         /* their lengths */
+    int nad,            /* how many */
+    unsigned char *p,   /* plaintext */
+    int len,            /* plaintext length */
+    unsigned char *v    /* synthetic IV (returned) */
+)
+{
+    unsigned char t[LEN_BUF + 16];
+    digest d, c;
+    int i, j;
+
+    memset(t, 0, 16);
+    cmac_digest(&k->mac, t, 16, &d);
+    for (i = 0; i < nad; i++)
+    {
+        cmac_double(d.d, d.d);
+        cmac_digest(&k->mac, ad[i], adlen[i], &c);
+        for (j = 0; j < 16; j++)
+            d.d[j] ^= c.d[j];
+    }
+
+    /*
+     * Fold the last value into the plaintext: at its end if there is
+     * a whole block, else after padding.
+     */
+    memcpy(t, p, len);
+    if (len >= 16)
+    {
+        for (i = 0; i < 16; i++)
+            t[len - 16 + i] ^= d.d[i];
+    }
+    else
+    {
+        cmac_double(d.d, d.d);
+        t[len] = 0x80;
+        memset(t + len + 1, 0, 15 - len);
+        for (i = 0; i < 16; i++)
+            t[i] ^= d.d[i];
+        len = 16;
+    }
+    cmac_digest(&k->mac, t, len, &c);
+    memcpy(v, c.d, 16);
+}
+
+/*
+ * siv_ctr() - encrypt or decrypt in counter mode
+ */
+static void siv_ctr(
+    struct siv *k,     /* key */
+    unsigned char *v,  /* synthetic IV */
+    unsigned char *in, /* input */
+    int len,           /* length */
+    unsigned char *out /* output (may be input) */
+)
+{
+    unsigned char q[16], ks[16];
+    unsigned int ctr;
+    int i, j;
+
+    /*
+     * The counter is the IV with the top bits of its last two 32-bit
+     * words cleared, counting up in the last word.
+     */
+    memcpy(q, v, 16);
+    q[8] &= 0x7f;
+    q[12] &= 0x7f;
+    memcpy(&ctr, q + 12, 4);
+    ctr = be32toh(ctr);
+    for (i = 0; i < len; i += 16)
+    {
+        memcpy(ks, q, 12);
+        *(unsigned int *)(ks + 12) = htobe32(ctr++);
+        aes_block(&k->ctr, ks);
+        for (j = 0; j < 16 && i + j < len; j++)
+            out[i + j] = in[i + j] ^ ks[j];
+    }
+}
+
+/*
+ * siv_seal() - encrypt and authenticate
+ */
+static void siv_seal(
+    struct siv *k,      /* key */
+    unsigned char **ad, /* associated data and nonce */
+    int *adlen,         /* their lengths */
+    int nad,            /* how many */
+    unsigned char *p,   /* plaintext */
+    int len,            /* plaintext length */
+    unsigned char *out  /* IV and ciphertext (returned) */
+)
+{
+    siv_s2v(k, ad, adlen, nad, p, len, out);
+    siv_ctr(k, out, p, len, out + 16);
+}
+
+/*
+ * siv_open() - decrypt and verify
+ */
+static int /* TRUE if authentic, FALSE if not */
+siv_open(
+    struct siv *k,      /* key */
+    unsigned char **ad, /* associated data and nonce */
+    int *adlen,         /* their lengths */
+    int nad,            /* how many */
+    unsigned char *c,   /* IV and ciphertext */
+    int len,            /* IV and ciphertext length */
+    unsigned char *out  /* plaintext (returned) */
+)
+{
+    unsigned char v[16];
+    int i, diff;
+
+    if (len < 16)
+        return (FALSE);
+
+    siv_ctr(k, c, c + 16, len - 16, out);
+    siv_s2v(k, ad, adlen, nad, out, len - 16, v);
+    for (diff = i = 0; i < 16; i++)
+        diff |= v[i] ^ c[i];
+    return (diff == 0);
+}
+
+/*
+ * nts_rotate() - make new master key
+ *
+ * The new key goes into the slot of the oldest, which no cookie made
+ * in the last NMASTER - 1 rotations can name, and is published with
+ * one store.  Server worker threads may still be opening a cookie
+ * with a key that is being retired, in which case the cookie fails
+ * and the client gets an NTS NAK, as it would a moment later anyway.
+ */
+void nts_rotate()
+{
+    unsigned char key[LEN_SIVKEY];
+    struct master *mp;
+    int n;
+
+    n = (mcur + 1) % NMASTER;
+    mp = &master[n];
+    if (getrandom(key, sizeof(key), 0) != sizeof(key) ||
+        getrandom(&mp->id, sizeof(mp->id), 0) != sizeof(mp->id))
+        return;
+
+    siv_init(&mp->k, key);
+    __atomic_store_n(&mcur, n, __ATOMIC_RELEASE);
+}
+
+/*
+ * nts_init() - make first master key
+ */
+void nts_init()
+{
+    mcur = NMASTER - 1;
+    nts_rotate();
+}
+
+/*
+ * nts_cookie() - seal keys into cookie
+ */
+static void nts_cookie(
+    unsigned char *c2s, /* client-to-server key */
+    unsigned char *s2c, /* server-to-client key */
+    unsigned char *out  /* cookie (returned) */
+)
+{
+    unsigned char p[LEN_PLAIN];
+    unsigned char *ad[1];
+    int adlen[1];
+    struct master *mp;
+
+    mp = &master[__atomic_load_n(&mcur, __ATOMIC_ACQUIRE)];
+    memcpy(out, &mp->id, 4);
+    nts_nonce(out + 4);
+    memcpy(p, c2s, LEN_SIVKEY);
+    memcpy(p + LEN_SIVKEY, s2c, LEN_SIVKEY);
+    ad[0] = out + 4;
+    adlen[0] = LEN_NONCE;
+    siv_seal(&mp->k, ad, adlen, 1, p, LEN_PLAIN, out + 4 + LEN_NONCE);
+}
+
+/*
+ * nts_ke() - make cookies for NTS-KE
+ */
+int /* cookie length (octets) or 0 if none made */
+nts_ke(
+    unsigned char *c2s,     /* client-to-server key */
+    unsigned char *s2c,     /* server-to-client key */
+    unsigned char *cookies, /* cookies (returned) */
+    int n                   /* number of cookies */
+)
+{
+    int i;
+
+    if (!nts_seed())
+        return (0);
+
+    for (i = 0; i < n; i++)
+        nts_cookie(c2s, s2c, cookies + i * LEN_COOKIE);
+    return (LEN_COOKIE);
+}
+
+/*
+ * nts_open() - open cookie
+ */
+static int /* TRUE if opened, FALSE if not */
+nts_open(
+    unsigned char *c,   /* cookie */
+    int len,            /* cookie length */
+    unsigned char *c2s, /* client-to-server key (returned) */
+    unsigned char *s2c  /* server-to-client key (returned) */
+)
+{
+    unsigned char p[LEN_PLAIN];
+    unsigned char *ad[1];
+    int adlen[1];
+    unsigned int id;
+    int i;
+
+    if (len != LEN_COOKIE)
+        return (FALSE);
+
+    memcpy(&id, c, 4);
+    for (i = 0; i < NMASTER; i++)
+    {
+        if (master[i].id == id)
+            break;
+    }
+    if (i == NMASTER)
+        return (FALSE);
+
+    ad[0] = c + 4;
+    adlen[0] = LEN_NONCE;
+    if (!siv_open(&master[i].k, ad, adlen, 1, c + 4 + LEN_NONCE,
+                  LEN_COOKIE - 4 - LEN_NONCE, p))
+        return (FALSE);
+
+    memcpy(c2s, p, LEN_SIVKEY);
+    memcpy(s2c, p + LEN_SIVKEY, LEN_SIVKEY);
+    return (TRUE);
+}
+
+/*
+ * nts_serve() - answer NTS request
+ */
+int /* TRUE if NTS request, FALSE if not */
+nts_serve(struct r *r /* receive packet pointer */)
+{
+    unsigned char p[LEN_BUF];
+    unsigned char *ad[2];
+    int adlen[2];
+    unsigned char *ef, *cookie, *auth;
+    int type, len, cklen, nholder, nlen, clen, rlen;
+    struct siv k;
+    struct nts n;
+    int i;
+
+    /*
+     * Take the extension fields apart.  A request needs exactly one
+     * unique identifier and an authenticator, which must come last.
+     * Other fields are ignored.
+     */
+    memset(&n, 0, sizeof(n));
+    cookie = auth = NULL;
+    cklen = nholder = 0;
+    for (i = LEN_PKT; i < r->len; i += len)
+    {
+        ef = r->pkt + i;
+        type = be16toh(*(unsigned short *)ef);
+        len = be16toh(*(unsigned short *)(ef + 2));
+        if (auth != NULL)
+            return (FALSE); /* field after authenticator */
+
+        switch (type)
+        {
+        case EF_UID:
+            if (n.uid != NULL || len - 4 < LEN_UID)
+                return (FALSE);
+            n.uid = ef + 4;
+            n.uidlen = len - 4;
+            break;
+
+        case EF_COOKIE:
+            if (cookie != NULL)
+                return (FALSE);
+            cookie = ef + 4;
+            cklen = len - 4;
+            break;
+
+        case EF_HOLDER:
+            nholder++;
+            break;
+
+        case EF_AUTH:
+            auth = ef;
+            break;
+        }
+    }
+    if (n.uid == NULL || auth == NULL)
+        return (FALSE);
+
+    if (!nts_seed())
+        return (TRUE); /* no reply possible */
+
+    /*
+     * Without the keys in the cookie, all the client can be told is
+     * to go back to NTS-KE.  The nonce and ciphertext lengths are
+     * checked against the authenticator field length.  The request
+     * is on the stack here, and so is only lent to the transmit
+     * routines.
+     */
+    r->nts = &n;
+    n.nak = TRUE;
+    nlen = be16toh(*(unsigned short *)(auth + 4));
+    clen = be16toh(*(unsigned short *)(auth + 6));
+    len = be16toh(*(unsigned short *)(auth + 2));
+    if (cookie == NULL || !nts_open(cookie, cklen, n.c2s, n.s2c) ||
+        nlen < LEN_NONCE || clen < 16 ||
+        8 + ((nlen + 3) & ~3) + ((clen + 3) & ~3) > len)
+    {
+        kod_xmit(r, "NTSN");
+        r->nts = NULL;
+        return (TRUE);
+    }
+
+    /*
+     * Check the request under the client-to-server key.  The
+     * associated data is everything before the authenticator, and the
+     * plaintext, if any, is fields the client wanted hidden.  None
+     * of those is understood here.
+     */
+    siv_init(&k, n.c2s);
+    ad[0] = r->pkt;
+    adlen[0] = auth - r->pkt;
+    ad[1] = auth + 8;
+    adlen[1] = nlen;
+    if (!siv_open(&k, ad, adlen, 2, auth + 8 + ((nlen + 3) & ~3), clen, p))
+    {
+        kod_xmit(r, "NTSN");
+        r->nts = NULL;
+        return (TRUE);
+    }
+
+    /*
+     * Send back a cookie for the one used up and one for each
+     * placeholder, but never a reply longer than the request.
+     */
+    n.nak = FALSE;
+    n.ncookie = min(1 + nholder, NCOOKIE);
+    rlen = LEN_PKT + 4 + n.uidlen + 8 + LEN_NONCE + 16;
+    while (n.ncookie > 1 && rlen + n.ncookie * (4 + LEN_COOKIE) > r->len)
+        n.ncookie--;
+    fast_xmit(r, M_SERV, A_NONE);
+    r->nts = NULL;
+    return (TRUE);
+}
+
+/*
+ * nts_encode() - encode reply extension fields
+ */
+int /* extension fields length (octets) */
+nts_encode(
+    struct nts *n,     /* NTS request */
+    unsigned char *buf /* packet buffer, header already encoded */
+)
+{
+    unsigned char p[NCOOKIE * (4 + LEN_COOKIE)];
+    unsigned char *ef, *ad[2];
+    int adlen[2];
+    struct siv k;
+    int len, plen, i;
+
+    /*
+     * The unique identifier goes back as it came.
+     */
+    ef = buf + LEN_PKT;
+    *(unsigned short *)ef = htobe16(EF_UID);
+    *(unsigned short *)(ef + 2) = htobe16(4 + n->uidlen);
+    memcpy(ef + 4, n->uid, n->uidlen);
+    len = 4 + n->uidlen;
+    if (n->nak)
+        return (len);
+
+    /*
+     * The new cookies are made with the keys of the one used up and
+     * sent encrypted under the server-to-client key, with the
+     * header and unique identifier as associated data.  The
+     * authenticator holds the nonce and the ciphertext, which are
+     * whole multiples of four octets.
+     */
+    for (i = 0, plen = 0; i < n->ncookie; i++, plen += 4 + LEN_COOKIE)
+    {
+        *(unsigned short *)(p + plen) = htobe16(EF_COOKIE);
+        *(unsigned short *)(p + plen + 2) = htobe16(4 + LEN_COOKIE);
+        nts_cookie(n->c2s, n->s2c, p + plen + 4);
+    }
+
+    ef = buf + LEN_PKT + len;
+    *(unsigned short *)ef = htobe16(EF_AUTH);
+    *(unsigned short *)(ef + 2) = htobe16(8 + LEN_NONCE + 16 + plen);
+    *(unsigned short *)(ef + 4) = htobe16(LEN_NONCE);
+    *(unsigned short *)(ef + 6) = htobe16(16 + plen);
+    nts_nonce(ef + 8);
+
+    siv_init(&k, n->s2c);
+    ad[0] = buf;
+    adlen[0] = LEN_PKT + len;
+    ad[1] = ef + 8;
+    adlen[1] = LEN_NONCE;
+    siv_seal(&k, ad, adlen, 2, p, plen, ef + 8 + LEN_NONCE);
+    return (len + 8 + LEN_NONCE + 16 + plen);
+}
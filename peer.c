@@ -1,4 +1,7 @@
 #include "global.c";
+#include <endian.h>     /* for be32toh() */
+#include <sys/random.h> /* for getrandom() */
+
 /*
  * A crypto-NAK packet includes the NTP header followed by a MAC
  * consisting only of the key identifier with value zero.  It tells
@@ -16,6 +19,26 @@
  */
 #define SGATE 3     /* spike gate (clock filter */
 #define BDELAY .004 /* broadcast delay (s) */
+#define MCAST(a) (be32toh(a) >> 28 == 0xe) /* IPv4 multicast address */
+
+/*
+ * Rate limit table entries pack a 24-bit address tag, a 24-bit time
+ * in 1/16 s and 16 bits of tokens into one word, so each is read and
+ * written with a single atomic operation.  A token is 1/16 s of
+ * credit, so a packet costs RINT * 16 tokens.
+ */
+#define R_TAG(e) ((e) >> 40)               /* address tag */
+#define R_TIME(e) (((e) >> 16) & 0xffffff) /* time of last packet */
+#define R_TOKENS(e) ((e) & 0xffff)         /* tokens left */
+#define R_ENTRY(tag, t, n) ((unsigned long long)(tag) << 40 | \
+                            (unsigned long long)((t) & 0xffffff) << 16 | (n))
+#define R_COST (RINT * 16)           /* tokens per packet */
+#define R_DEPTH (RBURST * RINT * 16) /* bucket depth (tokens) */
+
+static unsigned long long rtable[RTABLE]; /* rate limit table */
+static unsigned long long rkey[2];        /* rate limit hash key */
+static __thread tstamp kodsec;            /* kiss-o'-death second */
+static __thread int kodcnt;               /* kiss-o'-deaths this second */
 
 /*
  * Dispatch codes
@@ -61,14 +84,92 @@ int table[7][5] = {
  * A.5.1 receive()
  */
 
+/*
+ * authenticate() - determine authentication code of packet
+ */
+static int /* authentication code */
+authenticate(struct r *r /* receive packet pointer */)
+{
+    int has_mac; /* size of MAC */
+    digest dgst; /* computed digest */
+
+    /*
+     * The code is already known if mac_check() did the batch.
+     */
+    if (r->auth != A_UNKNOWN)
+        return (r->auth);
+
+    has_mac = r->maclen;
+    if (has_mac == 0)
+        return (A_NONE); /* not required */
+    else if (has_mac == 4)
+        return (A_CRYPTO); /* crypto-NAK */
+    else if (!mac(r->keyid, r->pkt, r->len, &dgst) ||
+             memcmp(&dgst, &r->mac, sizeof(dgst)) != 0)
+        return (A_ERROR); /* auth error */
+    else
+        return (A_OK); /* auth OK */
+}
+
+/*
+ * serve_client() - answer client packet with no association
+ *
+ * This is the FXMIT path of the dispatch matrix.  receive() and serve()
+ * both take it, so a client gets the same answer whichever socket the
+ * kernel hashes its packets to.
+ */
+static void serve_client(
+    struct r *r, /* receive packet pointer */
+    int rflags,  /* restrict flags */
+    int auth     /* authentication code */
+)
+{
+    if (rflags & R_NOSERVE)
+        return; /* service denied */
+
+    /*
+     * An NTS request carries its own authentication and is answered
+     * by nts_serve().
+     */
+    if (r->eflen > 0 && nts_serve(r))
+        return; /* NTS reply sent */
+
+    /*
+     * If unicast destination address, send server packet.  If
+     * authentication fails, send a crypto-NAK packet.
+     */
+    if (!MCAST(r->dstaddr))
+    {
+        if (AUTH(rflags & P_NOTRUST, auth))
+            fast_xmit(r, M_SERV, auth);
+        else if (auth == A_ERROR)
+            fast_xmit(r, M_SERV, A_CRYPTO);
+        return; /* M_SERV packet sent */
+    }
+
+    /*
+     * This must be manycast.  Do not respond if we are not
+     * synchronized or if our stratum is above the manycaster.
+     */
+    if (s.leap == NOSYNC || s.stratum > r->stratum)
+        return;
+
+    /*
+     * Respond only if authentication is OK.  Note that the unicast
+     * address is used, not the multicast.
+     */
+    if (AUTH(rflags & P_NOTRUST, auth))
+        fast_xmit(r, M_SERV, auth);
+}
+
 /*
  * receive() - receive packet and decode modes
  */
 void receive(struct r *r /* receive packet pointer */)
 {
     struct p *p; /* peer structure pointer */
+    int rflags;  /* restrict flags */
     int auth;    /* authentication code */
-    int has_mac; /* size of MAC */
     int synch;   /* synchronized switch */
 
     /*
@@ -78,9 +179,21 @@ void receive(struct r *r /* receive packet pointer */)
      * rejected.  There could be different lists for authenticated
      * clients and unauthenticated clients.
      */
-    if (!access(r))
+    rflags = access(r);
+    if (!rflags)
         return; /* access denied */
 
+    /*
+     * A source over its rate limit is dropped.  A client may first
+     * be told to back off with a RATE kiss-o'-death.
+     */
+    if (rflags & R_LIMITED)
+    {
+        if (rflags & R_KOD && r->mode == M_CLNT)
+            kod_xmit(r, "RATE");
+        return; /* rate exceeded */
+    }
+
     /*
      * The version must not be in the future.  Format checks include
      * packet length, MAC length and extension field lengths, if
@@ -89,9 +202,18 @@ void receive(struct r *r /* receive packet pointer */)
     if (r->version > VERSION /* or format error */)
         return; /* format error */
 
+    /*
+     * The dispatch matrix has a column for each mode from symmetric
+     * active to broadcast.  Control and private mode packets are not
+     * for this program.
+     */
+    if (r->mode < M_SACT || r->mode > M_BCST)
+        return; /* no such mode */
+
     /*
      * Authentication is conditioned by two switches that can be
-     * specified on a per-client basis.
+     * specified on a per-client basis.  They come in the restrict
+     * word returned by access().
      *
      * P_NOPEER     do not mobilize an association unless
      *              authenticated.
@@ -111,64 +233,22 @@ void receive(struct r *r /* receive packet pointer */)
      * one, the only acceptable outcome of y is OK.
      */
 
-    has_mac = /* length of MAC field */ 0;
-    if (has_mac == 0)
-    {
-        auth = A_NONE; /* not required */
-    }
-    else if (has_mac == 4)
-    {
-        auth = A_CRYPTO; /* crypto-NAK */
-    }
-    else
-    {
-        if (r->mac != md5(r->keyid))
-            auth = A_ERROR; /* auth error */
-        else
-            auth = A_OK; /* auth OK */
-    }
+    auth = authenticate(r);
 
     /*
      * Find association and dispatch code.  If there is no
      * association to match, the value of p->hmode is assumed NULL.
      */
     p = find_assoc(r);
-    switch (table[(unsigned int)(p->hmode)][(unsigned int)(r->mode)])
+    switch (table[p == NULL ? M_RSVD : (unsigned int)(p->hmode)]
+                 [(unsigned int)(r->mode) - 1])
     {
     /*
      * Client packet and no association.  Send server reply without
      * saving state.
      */
     case FXMIT:
-        /*
-         * If unicast destination address, send server packet.
-         * If authentication fails, send a crypto-NAK packet.
-         */
-
-        /* not multicast dstaddr */
-        if (0)
-        {
-            if (AUTH(p->flags & P_NOTRUST, auth))
-                fast_xmit(r, M_SERV, auth);
-            else if (auth == A_ERROR)
-                fast_xmit(r, M_SERV, A_CRYPTO);
-            return; /* M_SERV packet sent */
-        }
-
-        /*
-         * This must be manycast.  Do not respond if we are not
-         * synchronized or if our stratum is above the
-         * manycaster.
-         */
-        if (s.leap == NOSYNC || s.stratum > r->stratum)
-            return;
-
-        /*
-         * Respond only if authentication is OK.  Note that the
-         * unicast address is used, not the multicast.
-         */
-        if (AUTH(p->flags & P_NOTRUST, auth))
-            fast_xmit(r, M_SERV, auth);
+        serve_client(r, rflags, auth);
         return;
 
     /*
@@ -180,7 +260,7 @@ void receive(struct r *r /* receive packet pointer */)
      * match, the server packet is authentic.  Details omitted.
      */
     case MANY:
-        if (!AUTH(p->flags & (P_NOTRUST | P_NOPEER), auth))
+        if (!AUTH(rflags & (P_NOTRUST | P_NOPEER), auth))
             return; /* authentication error */
 
         p = mobilize(r->srcaddr, r->dstaddr, r->version, M_CLNT,
@@ -194,13 +274,13 @@ void receive(struct r *r /* receive packet pointer */)
      * symmetric active packet instead.
      */
     case NEWPS:
-        if (!AUTH(p->flags & P_NOTRUST, auth))
+        if (!AUTH(rflags & P_NOTRUST, auth))
         {
             if (auth == A_ERROR)
                 fast_xmit(r, M_SACT, A_CRYPTO);
             return; /* crypto-NAK packet sent */
         }
-        if (!AUTH(p->flags & P_NOPEER, auth))
+        if (!AUTH(rflags & P_NOPEER, auth))
         {
             fast_xmit(r, M_SACT, auth);
             return; /* M_SACT packet sent */
@@ -216,7 +296,7 @@ void receive(struct r *r /* receive packet pointer */)
      * initial volley feature in the reference implementation.
      */
     case NEWBC:
-        if (!AUTH(p->flags & (P_NOTRUST | P_NOPEER), auth))
+        if (!AUTH(rflags & (P_NOTRUST | P_NOPEER), auth))
             return; /* authentication error */
 
         if (!(s.flags & S_BCSTENAB))
@@ -247,6 +327,8 @@ void receive(struct r *r /* receive packet pointer */)
     case DSCRD:
         return; /* orphan abandoned */
     }
+    if (p == NULL)
+        return; /* no memory */
 
     /*
      * Next comes a rigorous schedule of timestamp checking.  If the
@@ -267,6 +349,11 @@ void receive(struct r *r /* receive packet pointer */)
      * If the origin timestamp is zero, the sender has not yet heard
      * from us.  Otherwise, if the origin timestamp does not match
      * the transmit timestamp, the packet is bogus.
+     *
+     * A symmetric peer in interleaved mode echoes instead the receive
+     * timestamp of our last packet, which is when its own previous
+     * packet arrived.  A peer that does so has interleaved mode on,
+     * so we follow it there.
      */
     synch = TRUE;
     if (r->mode != M_BCST)
@@ -274,14 +361,29 @@ void receive(struct r *r /* receive packet pointer */)
         if (r->org == 0)
             synch = FALSE; /* unsynchronized */
 
-        else if (r->org != p->xmt)
+        else if (r->org == p->xmt)
+            synch = TRUE; /* basic mode */
+
+        else if ((p->hmode == M_SACT || p->hmode == M_PASV) &&
+                 r->org == p->rec)
+            p->flags |= P_XLEAVE; /* interleaved mode */
+
+        else
             synch = FALSE; /* bogus packet */
     }
 
     /*
      * Update the origin and destination timestamps.  If
-     * unsynchronized or bogus, abandon ship.
-     */
+     * unsynchronized or bogus, abandon ship.  The timestamps of the
+     * previous packet are kept for interleaved mode: its receive
+     * timestamps at both ends and the transmit timestamp of our
+     * packet it answered.
+     */
+    p->xrec = p->prec;
+    p->xdst = p->rec;
+    p->xorg = p->porg;
+    p->prec = r->rec;
+    p->porg = p->xmt;
     p->org = r->xmt;
     p->rec = r->dst;
     if (!synch)
@@ -315,6 +417,57 @@ void receive(struct r *r /* receive packet pointer */)
     packet(p, r);
 }
 
+/*
+ * serve() - receive packet in a server worker thread
+ *
+ * The worker threads of the multi-worker server mode answer client
+ * packets on their own, since the FXMIT path keeps no state.  They do
+ * not touch the association table, which belongs to the system
+ * process; any other packet is handed to it by handoff().
+ */
+void serve(struct r *r /* receive packet pointer */)
+{
+    int rflags; /* restrict flags */
+    int auth;   /* authentication code */
+
+    rflags = access(r);
+    if (!rflags)
+        return; /* access denied */
+
+    if (rflags & R_LIMITED)
+    {
+        if (rflags & R_KOD && r->mode == M_CLNT)
+            kod_xmit(r, "RATE");
+        return; /* rate exceeded */
+    }
+
+    if (r->version > VERSION /* or format error */)
+        return; /* format error */
+
+    /*
+     * The dispatch matrix has a column for each mode from symmetric
+     * active to broadcast.  Control and private mode packets are not
+     * for this program.
+     */
+    if (r->mode < M_SACT || r->mode > M_BCST)
+        return; /* no such mode */
+
+    /*
+     * A client packet matches an association only if the local host
+     * is a client of the same remote address, in which case the
+     * dispatch matrix says to discard it anyway.  So every client
+     * packet takes the FXMIT path, the same one as in receive().
+     */
+    if (r->mode != M_CLNT)
+    {
+        handoff(r);
+        return;
+    }
+
+    auth = authenticate(r);
+    serve_client(r, rflags, auth);
+}
+
 /*
  * packet() - process packet and compute offset, delay, and
  * dispersion.
@@ -327,6 +480,8 @@ void packet(
     double offset; /* sample offsset */
     double delay;  /* sample delay */
     double disp;   /* sample dispersion */
+    tstamp org;    /* our departure time */
+    tstamp xmt;    /* peer departure time */
 
     /*
      * By golly the packet is valid.  Light up the remaining header
@@ -336,14 +491,27 @@ void packet(
      *  convenience at stratum 0.
      */
     p->leap = r->leap;
+
+    /*
+     * A RATE kiss-o'-death says we poll too often.  Stop any burst
+     * and back off to the next poll interval.
+     */
+    if (r->stratum == 0 && memcmp(&r->refid, "RATE", 4) == 0)
+    {
+        p->burst = 0;
+        p->ppoll = max(r->poll, p->hpoll + 1);
+        poll_update(p, p->hpoll + 1);
+        return; /* rate exceeded */
+    }
     if (r->stratum == 0)
-        p->stratum = MAXSTRAT;
+        hot.stratum[p->h] = MAXSTRAT;
     else
-        p->stratum = r->stratum;
+        hot.stratum[p->h] = r->stratum;
     p->pmode = r->mode;
     p->ppoll = r->poll;
-    p->rootdelay = FP2D(r->rootdelay);
-    p->rootdisp = FP2D(r->rootdisp);
+    hot.rootdelay[p->h] = FP2D(r->rootdelay);
+    hot.rootdisp[p->h] = FP2D(r->rootdisp);
+    hot.distt[p->h] = NOEPOCH;
     p->refid = r->refid;
     p->reftime = r->reftime;
 
@@ -351,13 +519,19 @@ void packet(
      * Verify the server is synchronized with valid stratum and
      * reference time not later than the transmit time.
      */
-    if (p->leap == NOSYNC || p->stratum >= MAXSTRAT)
+    if (p->leap == NOSYNC || hot.stratum[p->h] >= MAXSTRAT)
         return; /* unsynchronized */
 
     /*
-     * Verify valid root distance.
+     * Verify valid root distance.  The transmit timestamp of an
+     * interleaved packet is that of the previous one, which the
+     * reference time may well be later than, so the receive
+     * timestamp stands in for it.
      */
-    if (r->rootdelay / 2 + r->rootdisp >= MAXDISP || p->reftime > r->xmt)
+    xmt = r->xmt;
+    if (p->flags & P_XLEAVE && r->org != p->xmt)
+        xmt = r->rec;
+    if (r->rootdelay / 2 + r->rootdisp >= MAXDISP || lfp_sub(p->reftime, xmt) > 0)
         return; /* invalid header values */
 
     poll_update(p, p->hpoll);
@@ -377,22 +551,74 @@ void packet(
      * with very fast networks, the delay can appear negative.  In
      * order to avoid violating the Principle of Least Astonishment,
      * the delay is clamped not less than the system precision.
+     *
+     * With P_XSTAMP or P_XLEAVE our departure time is the one the
+     * kernel reported for the request, which left after the
+     * transmit timestamp echoed in r->org was read.  If there is no
+     * report, r->org has to do, unless it was itself the departure
+     * time of the packet before.
+     *
+     * An interleaved packet carries the departure time of the
+     * previous packet of the peer, so the sample is for the round
+     * before: our departure time of the packet it answered, when
+     * that arrived there, when the previous packet left and when it
+     * arrived here.  A lost or crossed packet pairs times from
+     * different rounds, which is off by a poll interval and shows
+     * up as a negative delay.
      */
     if (p->pmode == M_BCST)
     {
-        offset = LFP2D(r->xmt - r->dst);
+        offset = lfp_d(lfp_sub(r->xmt, r->dst));
         delay = BDELAY;
         disp = LOG2D(r->precision) + LOG2D(s.precision) + PHI * 2 * BDELAY;
     }
+    else if (p->flags & P_XLEAVE && r->org != p->xmt)
+    {
+        org = xmit_stamp(p->xorg);
+        if (org == 0 || p->xrec == 0)
+            return; /* no previous round */
+
+        offset = lfp_d(lfp_sub(p->xrec, org) + lfp_sub(r->xmt, p->xdst)) / 2;
+        delay = lfp_d(lfp_sub(p->xdst, org) - lfp_sub(r->xmt, p->xrec));
+        if (delay < 0)
+            return; /* rounds mismatched */
+
+        delay = max(delay, LOG2D(s.precision));
+        disp = LOG2D(r->precision) + LOG2D(s.precision) + PHI * lfp_d(lfp_sub(p->xdst, org));
+    }
     else
     {
-        offset = (LFP2D(r->rec - r->org) + LFP2D(r->dst - r->xmt)) / 2;
-        delay = max(LFP2D(r->dst - r->org) - LFP2D(r->rec - r->xmt), LOG2D(s.precision));
-        disp = LOG2D(r->precision) + LOG2D(s.precision) + PHI * LFP2D(r->dst - r->org);
+        org = 0;
+        if (p->flags & (P_XSTAMP | P_XLEAVE))
+            org = xmit_stamp(r->org);
+        if (org == 0 && p->xleave)
+            return; /* departure time unknown */
+
+        if (org == 0)
+            org = r->org;
+        offset = lfp_d(lfp_sub(r->rec, org) + lfp_sub(r->xmt, r->dst)) / 2;
+        delay = max(lfp_d(lfp_sub(r->dst, org) - lfp_sub(r->xmt, r->rec)), LOG2D(s.precision));
+        disp = LOG2D(r->precision) + LOG2D(s.precision) + PHI * lfp_d(lfp_sub(r->dst, org));
     }
     clock_filter(p, offset, delay, disp);
 }
 
+/*
+ * Compare and exchange stages a and b of the sort list by delay.  The
+ * conditional moves leave no branch for the predictor to miss.
+ */
+#define CSWAP(a, b)                                               \
+  do                                                              \
+  {                                                               \
+    double ka = key[a], kb = key[b];                              \
+    int ia = idx[a], ib = idx[b];                                 \
+                                                                  \
+    key[a] = ka <= kb ? ka : kb;                                  \
+    key[b] = ka <= kb ? kb : ka;                                  \
+    idx[a] = ka <= kb ? ia : ib;                                  \
+    idx[b] = ka <= kb ? ib : ia;                                  \
+  } while (0)
+
 /*
  * clock_filter(p, offset, delay, dispersion) - select the best from the
  * latest eight delay/offset samples.
@@ -404,52 +630,96 @@ void clock_filter(
     double disp    /* dispersion */
 )
 {
-    struct f f[NSTAGE]; /* sorted list */
-    double dtemp;
+    double key[NSTAGE];  /* sort key */
+    int idx[NSTAGE];     /* sorted list */
+    double age[NSTAGE];  /* aged dispersion */
+    struct f *f, *f0;
+    double dtemp, etemp, jtemp;
     int i;
 
     /*
      * The clock filter contents consist of eight tuples (offset,
-     * delay, dispersion, time).  Shift each tuple to the left,
-     * discarding the leftmost one.  As each tuple is shifted,
-     * increase the dispersion since the last filter update.  At the
-     * same time, copy each tuple to a temporary list.  After this,
-     * place the (offset, delay, disp, time) in the vacated
-     * rightmost tuple.
-     */
-    for (i = 1; i < NSTAGE; i++)
+     * delay, dispersion, time), kept in a ring.  Put the new tuple
+     * in place of the oldest one.  A tuple's dispersion grows by PHI
+     * for every second since it was taken, so rather than add to
+     * each one at every update, work out its age from its time when
+     * it is wanted.
+     */
+    f = &p->f[p->fnext];
+    f->t = c.t;
+    f->offset = offset;
+    f->delay = delay;
+    f->disp = disp;
+    p->fnext = (p->fnext + 1) % NSTAGE;
+
+    /*
+     * Sort the tuples by increasing f[].delay.  A tuple whose
+     * dispersion has grown to MAXDISP carries no information, so it
+     * goes to the end whatever its delay.  The list is sorted by a
+     * network of 19 compare-exchanges, the fewest for eight items,
+     * on the delays and stage numbers.  The first entry on the
+     * sorted list represents the best sample, but it might be old.
+     */
+    for (i = 0; i < NSTAGE; i++)
     {
-        p->f[i] = p->f[i - 1];
-        p->f[i].disp += PHI * (c.t - p->t);
-        f[i] = p->f[i];
+        f = &p->f[i];
+        age[i] = min(f->disp + PHI * (c.t - f->t), MAXDISP);
+        key[i] = age[i] < MAXDISP ? f->delay : MAXDISP;
+        idx[i] = i;
     }
-    p->f[0].t = c.t;
-    p->f[0].offset = offset;
-    p->f[0].delay = delay;
-    p->f[0].disp = disp;
-    f[0] = p->f[0];
+    CSWAP(0, 2);
+    CSWAP(1, 3);
+    CSWAP(4, 6);
+    CSWAP(5, 7);
+
+    CSWAP(0, 4);
+    CSWAP(1, 5);
+    CSWAP(2, 6);
+    CSWAP(3, 7);
+
+    CSWAP(0, 1);
+    CSWAP(2, 3);
+    CSWAP(4, 5);
+    CSWAP(6, 7);
+
+    CSWAP(2, 4);
+    CSWAP(3, 5);
+
+    CSWAP(1, 4);
+    CSWAP(3, 6);
+
+    CSWAP(1, 2);
+    CSWAP(3, 4);
+    CSWAP(5, 6);
 
     /*
-     * Sort the temporary list of tuples by increasing f[].delay.
-     * The first entry on the sorted list represents the best
-     * sample, but it might be old.
+     * The peer dispersion is the weighted sum of the aged sorted
+     * dispersions, the weight halving at each step down the list.
+     * The peer jitter is the RMS difference between the offsets and
+     * that of the first entry.
      */
-    dtemp = p->offset;
-    p->offset = f[0].offset;
-    p->delay = f[0].delay;
+    f0 = &p->f[idx[0]];
+    etemp = 0;
+    jtemp = 0;
     for (i = 0; i < NSTAGE; i++)
     {
-        p->disp += f[i].disp / (2 ^ (i + 1));
-        p->jitter += SQUARE(f[i].offset - f[0].offset);
+        f = &p->f[idx[i]];
+        etemp += age[idx[i]] * LOG2D(-(i + 1));
+        jtemp += SQUARE(f->offset - f0->offset);
     }
-    p->jitter = max(SQRT(p->jitter), LOG2D(s.precision));
+    dtemp = hot.offset[p->h];
+    hot.offset[p->h] = f0->offset;
+    hot.delay[p->h] = f0->delay;
+    hot.disp[p->h] = etemp;
+    hot.jitter[p->h] = max(SQRT(jtemp / (NSTAGE - 1)), LOG2D(s.precision));
+    hot.distt[p->h] = NOEPOCH;
 
     /*
      * Prime directive: use a sample only once and never a sample
      * older than the latest one, but anything goes before first
      * synchronized.
      */
-    if (f[0].t - p->t <= 0 && s.leap != NOSYNC)
+    if (f0->t - hot.t[p->h] <= 0 && s.leap != NOSYNC)
         return;
 
     /*
@@ -459,14 +729,34 @@ void clock_filter(
      * less than twice the system poll interval, dump the spike.
      * Otherwise, and if not in a burst, shake out the truechimers.
      */
-    if (fabs(p->offset - dtemp) > SGATE * p->jitter && (f[0].t -
-                                                        p->t) < 2 * s.poll)
+    if (fabs(hot.offset[p->h] - dtemp) > SGATE * hot.jitter[p->h] &&
+        f0->t - hot.t[p->h] < 2 * LOG2D(s.poll))
         return;
 
-    p->t = f[0].t;
-    if (p->burst == 0)
-        clock_select();
-    return;
+    hot.t[p->h] = f0->t;
+    hot.distt[p->h] = NOEPOCH;
+    if (p->burst != 0)
+        return;
+
+    /*
+     * A sample from an association that was not fit at the last
+     * selection and is not fit now cannot change the outcome, so
+     * there is no need to select again.  Neither is there any hurry
+     * for a sample from other than the system peer, which does not
+     * update the clock: once selection has run in this second, it
+     * is left to clock_adjust(), which runs it once for all such
+     * samples at the next second.  A sample from the system peer, or
+     * any sample with no system peer, gets a selection at once.
+     */
+    if (!hot.fit[p->h] && !fit(p))
+        return;
+
+    if (p != s.p && s.p != NULL && s.selt == c.t)
+    {
+        s.pending = TRUE;
+        return;
+    }
+    clock_select();
 }
 
 /*
@@ -478,7 +768,7 @@ int fit(struct p *p /* peer structure pointer */)
      * A stratum error occurs if (1) the server has never been
      * synchronized, (2) the server stratum is invalid.
      */
-    if (p->leap == NOSYNC || p->stratum >= MAXSTRAT)
+    if (p->leap == NOSYNC || hot.stratum[p->h] >= MAXSTRAT)
         return (FALSE);
 
     /*
@@ -523,14 +813,20 @@ void clear(
      * Typical resources are not detailed here, but they include
      * dynamically allocated structures for keys, certificates, etc.
      * If an ephemeral association and not initialization, return
-     * the association memory as well.
+     * the association memory as well.  The slot is left with the
+     * reserved host mode, so a caller further up that still holds
+     * the pointer can tell it has gone.  Pool slots are never
+     * unmapped, and nothing is mobilized before the caller looks.
      */
     /* return resources */
     if (s.p == p)
         s.p = NULL;
     if (kiss != X_INIT && (p->flags & P_EPHEM))
     {
-        free(p);
+        timer_cancel(p);
+        unlink_assoc(p);
+        p->hmode = M_RSVD;
+        free_assoc(p);
         return;
     }
 
@@ -539,22 +835,30 @@ void clear(
      */
     memset(BEGIN_CLEAR(p), LEN_CLEAR, 0);
     p->leap = NOSYNC;
-    p->stratum = MAXSTRAT;
+    hot.stratum[p->h] = MAXSTRAT;
     p->ppoll = MAXPOLL;
     p->hpoll = MINPOLL;
-    p->disp = MAXDISP;
-    p->jitter = LOG2D(s.precision);
+    hot.offset[p->h] = 0;
+    hot.delay[p->h] = 0;
+    hot.disp[p->h] = MAXDISP;
+    hot.jitter[p->h] = LOG2D(s.precision);
+    hot.distt[p->h] = NOEPOCH;
     p->refid = kiss;
     for (i = 0; i < NSTAGE; i++)
+    {
+        p->f[i].t = c.t;
+        p->f[i].delay = MAXDISP;
         p->f[i].disp = MAXDISP;
+    }
 
     /*
      * Randomize the first poll just in case thousands of broadcast
      * clients have just been stirred up after a long absence of the
      * broadcast server.
      */
-    p->outdate = p->t = c.t;
+    p->outdate = hot.t[p->h] = c.t;
     p->nextdate = p->outdate + (random() & ((1 << MINPOLL) - 1));
+    timer_arm(p);
 }
 
 /*
@@ -567,65 +871,343 @@ void fast_xmit(
 )
 {
     struct x x;
+    unsigned char hdr[LEN_PKT]; /* header template copy */
+    unsigned int seq;           /* system variables sequence */
 
     /*
      * Initialize header and transmit timestamp.  Note that the
      * transmit version is copied from the receive version.  This is
-     * for backward compatibility.
+     * for backward compatibility.  The system variables come
+     * already encoded in the header template.  This routine also
+     * runs in the server worker threads, so the template is copied
+     * again if the system process updated it meanwhile.
      */
     x.version = r->version;
     x.srcaddr = r->dstaddr;
     x.dstaddr = r->srcaddr;
-    x.leap = s.leap;
+    x.dstport = r->srcport;
     x.mode = mode;
-    if (s.stratum == MAXSTRAT)
-        x.stratum = 0;
-    else
-        x.stratum = s.stratum;
     x.poll = r->poll;
-    x.precision = s.precision;
-    x.rootdelay = D2FP(s.rootdelay);
-    x.rootdisp = D2FP(s.rootdisp);
-    x.refid = s.refid;
-    x.reftime = s.reftime;
+    do
+    {
+        seq = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+        memcpy(hdr, s.hdr, LEN_PKT);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq & 1 || seq != __atomic_load_n(&s.seq, __ATOMIC_RELAXED));
+    x.hdr = hdr;
+    x.nts = r->nts;
     x.org = r->xmt;
     x.rec = r->dst;
     x.xmt = get_time();
+    x.stamp = FALSE;
 
     /*
      * If the authentication code is A.NONE, include only the
      * header; if A.CRYPTO, send a crypto-NAK; if A.OK, send a valid
      * MAC.  Use the key ID in the received packet and the key in
-     * the local key cache.
+     * the local key cache.  An NTS reply is authenticated by the
+     * extension fields nts_serve() asked for instead.
      */
+    x.maclen = 0;
     if (auth != A_NONE)
     {
         if (auth == A_CRYPTO)
         {
+            x.maclen = 4;
             x.keyid = 0;
         }
         else
         {
+            x.maclen = 20;
             x.keyid = r->keyid;
-            x.dgst = md5(x.keyid);
         }
     }
     xmit_packet(&x);
 }
 
+/*
+ * kod_xmit() - transmit a kiss-o'-death for receive packet r
+ */
+void kod_xmit(
+    struct r *r, /* receive packet pointer */
+    char *code   /* kiss code */
+)
+{
+    struct x x;
+
+    /*
+     * Kiss-o'-deaths are themselves limited to RKOD a second, so a
+     * flood with forged source addresses cannot be reflected at
+     * anyone at full rate.
+     */
+    if (r->dst >> 32 != kodsec)
+    {
+        kodsec = r->dst >> 32;
+        kodcnt = 0;
+    }
+    if (kodcnt++ >= RKOD)
+        return;
+
+    /*
+     * The header carries no system variables, just the kiss code.
+     * The origin timestamp lets the client match it to its request,
+     * as does the unique identifier of an NTS NAK.
+     */
+    x.version = r->version;
+    x.srcaddr = r->dstaddr;
+    x.dstaddr = r->srcaddr;
+    x.dstport = r->srcport;
+    x.hdr = NULL;
+    x.nts = r->nts;
+    x.leap = NOSYNC;
+    x.mode = M_SERV;
+    x.stratum = 0;
+    x.poll = max(r->poll, MINPOLL);
+    x.precision = s.precision;
+    x.rootdelay = 0;
+    x.rootdisp = 0;
+    memcpy(&x.refid, code, 4);
+    x.reftime = 0;
+    x.org = r->xmt;
+    x.rec = r->dst;
+    x.xmt = r->dst;
+    x.stamp = FALSE;
+    x.maclen = 0;
+    xmit_packet(&x);
+}
+
 /*
  * access() - determine access restrictions
  */
-int access(struct r *r /* receive packet pointer */)
+int /* restrict flags */
+access(struct r *r /* receive packet pointer */)
 {
+    unsigned long long *e; /* rate limit table entry */
+    unsigned long long old, new;
+    unsigned long long h;  /* address hash */
+    unsigned int tag, t;
+    int rflags; /* restrict word */
+    int n, kod;
+
     /*
      * The access control list is an ordered set of tuples
      * consisting of an address, mask, and restrict word containing
-     * defined bits.  The list is searched for the first match on
+     * defined bits.  The list is searched for the longest match on
      * the source address (r->srcaddr) and the associated restrict
-     * word is returned.
+     * word is returned.  The lists are compiled into a table where
+     * the search is at most three loads.
+     */
+    rflags = acl_lookup(r->srcaddr);
+    if (!(rflags & R_ACCESS))
+        return (0);
+
+    /*
+     * Only the restrict lines that ask for it limit the rate, since
+     * many clients behind one NAT address look like one busy source.
+     * Server packets are never limited.  They answer our own
+     * requests and come no faster than we poll, and an upstream
+     * server shared by many clients must not have its replies to us
+     * throttled.  Unsolicited ones find no association and are
+     * dropped anyway.
+     */
+    if (!(rflags & R_LIMIT) || r->mode == M_SERV)
+        return (rflags);
+
+    /*
+     * Rate limit each source with a token bucket in a fixed table
+     * indexed by a hash of the address, keyed at random so no one
+     * can tell which addresses share an entry.  The tag in the entry
+     * tells whether it belongs to this source.  If not, the source
+     * takes the entry over with the tokens it has built up, but no
+     * more than half a bucket.  Two sources that share an entry thus
+     * cannot refill it for each other by taking turns, and a flood
+     * from forged addresses only churns the table, whose size never
+     * changes.  The time is the receive timestamp in 1/16 s.
+     */
+    h = sip_hash(rkey, (unsigned int)r->srcaddr, 0, 8);
+    e = &rtable[h >> 32 & (RTABLE - 1)];
+    tag = h >> 8 & 0xffffff;
+    t = r->dst >> 28 & 0xffffff;
+    old = __atomic_load_n(e, __ATOMIC_RELAXED);
+    n = R_DEPTH / 2;
+    if (old != 0)
+        n = R_TOKENS(old) + ((t - R_TIME(old)) & 0xffffff);
+    n = min(n, R_TAG(old) == tag ? R_DEPTH : R_DEPTH / 2);
+
+    /*
+     * Updates race only between threads serving the same entry.  The
+     * loser of the compare-and-swap lets its packet through rather
+     * than try again, which keeps the cost per packet fixed.
+     */
+    if (n < R_COST)
+    {
+        /*
+         * A kiss-o'-death costs half a packet, so a source that
+         * keeps hammering gets one at most every RINT / 2 seconds
+         * and silence in between.
+         */
+        kod = n >= R_COST / 2;
+        if (kod)
+            n -= R_COST / 2;
+        new = R_ENTRY(tag, t, n);
+        if (!__atomic_compare_exchange_n(e, &old, new, FALSE,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+            return (rflags);
+
+        if (kod)
+            return (rflags | R_LIMITED | R_KOD);
+        return (rflags | R_LIMITED);
+    }
+    new = R_ENTRY(tag, t, n - R_COST);
+    __atomic_compare_exchange_n(e, &old, new, FALSE, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+    return (rflags);
+}
+
+/*
+ * rate_init() - draw the rate limit hash key
+ *
+ * This is done once at startup, before any thread serves packets.
+ */
+int /* TRUE if drawn, FALSE if no randomness */
+rate_init()
+{
+    return (getrandom(rkey, sizeof(rkey), 0) == sizeof(rkey));
+}
+
+/*
+ * sel_reserve() - make room in the chime and survivor lists
+ *
+ * The lists hold three chime entries and one survivor per
+ * association, the chime list as much again for sorting, and the
+ * intersection sweep four counts per association and one more.
+ * mobilize() grows them along with the association table and they
+ * are never shrunk, so clock_select() itself never allocates.
+ */
+int /* TRUE if room, FALSE if no memory */
+sel_reserve(int n /* number of associations */)
+{
+    struct m *m; /* new chime list */
+    struct v *v; /* new survivor list */
+    int *w;      /* new sweep */
+    int nlist;
+
+    if (n <= s.nlist)
+        return (TRUE);
+
+    nlist = max(n, 2 * s.nlist);
+    m = realloc(s.m, 6 * nlist * sizeof(struct m));
+    if (m == NULL)
+        return (FALSE);
+
+    s.m = m;
+    v = realloc(s.v, nlist * sizeof(struct v));
+    if (v == NULL)
+        return (FALSE);
+
+    s.v = v;
+    w = realloc(s.w, 4 * (nlist + 1) * sizeof(int));
+    if (w == NULL)
+        return (FALSE);
+
+    s.w = w;
+    s.nlist = nlist;
+    return (TRUE);
+}
+
+/*
+ * Chime list sort.  Short lists, which is nearly all of them, are
+ * sorted by insertion.  Longer ones get a least significant digit
+ * radix sort on the bits of the edge, rearranged so they compare as
+ * unsigned integers the way the doubles compare.  Eight bits go at a
+ * time, and a digit that is the same throughout, as the top ones
+ * mostly are, costs no pass.
+ */
+#define NSORT 48 /* longest list sorted by insertion */
+
+#define EDGEKEY(k, d)                                                 \
+    do                                                                \
+    {                                                                 \
+        memcpy(&(k), &(d), sizeof(k));                                \
+        (k) ^= -((k) >> 63) | 1ULL << 63;                             \
+    } while (0)
+
+/*
+ * sel_sort() - sort chime list by edge, lowest first
+ */
+static void sel_sort(
+    struct m *m,  /* chime list */
+    int n,        /* entries */
+    struct m *tmp /* scratch, n entries */
+)
+{
+    static int count[8][256];
+    struct m *src, *dst, *t;
+    struct m e;
+    unsigned long long k;
+    int d, i, j, sum, c;
+
+    if (n <= NSORT)
+    {
+        for (i = 1; i < n; i++)
+        {
+            e = m[i];
+            for (j = i; j > 0 && m[j - 1].edge > e.edge; j--)
+                m[j] = m[j - 1];
+            m[j] = e;
+        }
+        return;
+    }
+
+    /*
+     * Count all the digits in one pass, then sort stably on each
+     * digit from the lowest.
      */
-    return (/* access bits */ 0);
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+    {
+        EDGEKEY(k, m[i].edge);
+        for (d = 0; d < 8; d++)
+            count[d][k >> (8 * d) & 0xff]++;
+    }
+    src = m;
+    dst = tmp;
+    for (d = 0; d < 8; d++)
+    {
+        EDGEKEY(k, m[0].edge);
+        if (count[d][k >> (8 * d) & 0xff] == n)
+            continue;
+
+        for (sum = 0, i = 0; i < 256; i++)
+        {
+            c = count[d][i];
+            count[d][i] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n; i++)
+        {
+            EDGEKEY(k, src[i].edge);
+            dst[count[d][k >> (8 * d) & 0xff]++] = src[i];
+        }
+        t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != m)
+        memcpy(m, src, n * sizeof(struct m));
+}
+
+/*
+ * sel_order() - order survivors by metric, best first
+ */
+static int sel_order(const void *a, const void *b)
+{
+    const struct v *x = a, *y = b;
+
+    if (x->metric != y->metric)
+        return (x->metric < y->metric ? -1 : 1);
+    return (0);
 }
 
 /*
@@ -636,7 +1218,8 @@ void clock_select()
     struct p *p, *osys;      /* peer structure pointers */
     double low, high;        /* correctness interval extents */
     int allow, found, chime; /* used by intersection algorithm */
-    int n, i, j;
+    double mean, dtemp;      /* used by clustering algorithm */
+    int n, npeer, i, j;
 
     /*
      * We first cull the falsetickers from the server population,
@@ -652,22 +1235,32 @@ void clock_select()
      */
     osys = s.p;
     s.p = NULL;
+    s.selt = c.t;
+    s.pending = FALSE;
     n = 0;
-    while (fit(p))
+    for (i = 0; i < hot.n; i++)
     {
+        p = hot.p[i];
+        hot.fit[i] = fit(p);
+        if (!hot.fit[i])
+            continue;
+
+        dtemp = root_dist(p);
         s.m[n].p = p;
         s.m[n].type = +1;
-        s.m[n].edge = p->offset + root_dist(p);
+        s.m[n].edge = hot.offset[i] + dtemp;
         n++;
         s.m[n].p = p;
         s.m[n].type = 0;
-        s.m[n].edge = p->offset;
+        s.m[n].edge = hot.offset[i];
         n++;
         s.m[n].p = p;
         s.m[n].type = -1;
-        s.m[n].edge = p->offset - root_dist(p);
+        s.m[n].edge = hot.offset[i] - dtemp;
         n++;
     }
+    npeer = n / 3;
+    sel_sort(s.m, n, s.m + 3 * s.nlist);
 
     /*
      * Find the largest contiguous intersection of correctness
@@ -675,46 +1268,51 @@ void clock_select()
      * found is the number of midpoints.  Note that the edge values
      * are limited to the range +-(2 ^ 30) < +-2e9 by the timestamp
      * calculations.
-     */
-    low = 2e9;
-    high = -2e9;
-    for (allow = 0; 2 * allow < n; allow++)
+     *
+     * For a given allow, the lower endpoint is the first edge, from
+     * lowest to highest, where npeer - allow intervals are open at
+     * once, and the upper endpoint likewise from highest to lowest.
+     * Found counts the midpoints passed on the way in from either
+     * end.  Rather than scan again for every allow, one sweep each
+     * way notes in s.w where each count of open intervals is first
+     * reached and how many midpoints lie before it.
+     */
+    for (i = 0; i <= npeer; i++)
     {
-
-        /*
-         * Scan the chime list from lowest to highest to find
-         * the lower endpoint.
-         */
-        found = 0;
-        chime = 0;
-        for (i = 0; i < n; i++)
+        s.w[4 * i] = -1;
+        s.w[4 * i + 2] = -1;
+    }
+    found = 0;
+    chime = 0;
+    for (i = 0; i < n; i++)
+    {
+        chime -= s.m[i].type;
+        if (chime > 0 && s.w[4 * chime] < 0)
         {
-            chime -= s.m[i].type;
-            if (chime >= n - found)
-            {
-                low = s.m[i].edge;
-                break;
-            }
-            if (s.m[i].type == 0)
-                found++;
+            s.w[4 * chime] = i;
+            s.w[4 * chime + 1] = found;
         }
-
-        /*
-         * Scan the chime list from highest to lowest to find
-         * the upper endpoint.
-         */
-        chime = 0;
-        for (i = n - 1; i >= 0; i--)
+        if (s.m[i].type == 0)
+            found++;
+    }
+    found = 0;
+    chime = 0;
+    for (i = n - 1; i >= 0; i--)
+    {
+        chime += s.m[i].type;
+        if (chime > 0 && s.w[4 * chime + 2] < 0)
         {
-            chime += s.m[i].type;
-            if (chime >= n - found)
-            {
-                high = s.m[i].edge;
-                break;
-            }
-            if (s.m[i].type == 0)
-                found++;
+            s.w[4 * chime + 2] = i;
+            s.w[4 * chime + 3] = found;
         }
+        if (s.m[i].type == 0)
+            found++;
+    }
+
+    low = 2e9;
+    high = -2e9;
+    for (allow = 0; 2 * allow < npeer; allow++)
+    {
         /*
          * If the number of midpoints is greater than the number
          * of allowed falsetickers, the intersection contains at
@@ -723,30 +1321,49 @@ void clock_select()
          * around again.  If not and the intersection is
          * non-empty, declare success.
          */
+        j = 4 * (npeer - allow);
+        if (s.w[j] < 0 || s.w[j + 2] < 0)
+            continue;
+
+        found = s.w[j + 1] + s.w[j + 3];
         if (found > allow)
             continue;
 
+        low = s.m[s.w[j]].edge;
+        high = s.m[s.w[j + 2]].edge;
         if (high > low)
             break;
     }
 
+    /*
+     * Without a majority clique there are no truechimers.
+     */
+    if (2 * allow >= npeer)
+        return;
+
     /*
      * Clustering algorithm.  Construct a list of survivors (p,
      * metric) from the chime list, where metric is dominated first
      * by stratum and then by root distance.  All other things being
-     * equal, this is the order of preference.
+     * equal, this is the order of preference.  Each association
+     * is taken by its midpoint, so it makes the list at most once.
+     * Sort the list by metric, best first.
      */
     s.n = 0;
     for (i = 0; i < n; i++)
     {
-        if (s.m[i].edge < low || s.m[i].edge > high)
+        if (s.m[i].type != 0 || s.m[i].edge < low ||
+            s.m[i].edge > high)
             continue;
 
         p = s.m[i].p;
-        s.v[n].p = p;
-        s.v[n].metric = MAXDIST * p->stratum + root_dist(p);
+        s.v[s.n].p = p;
+        s.v[s.n].dist = root_dist(p);
+        s.v[s.n].metric = MAXDIST * hot.stratum[p->h] + s.v[s.n].dist;
+        s.v[s.n].offset = hot.offset[p->h];
         s.n++;
     }
+    qsort(s.v, s.n, sizeof(struct v), sel_order);
 
     /*
      * There must be at least NSANE survivors to satisfy the
@@ -759,36 +1376,50 @@ void clock_select()
 
     /*
      * For each association p in turn, calculate the selection
-     * jitter p->sjitter as the square root of the sum of squares
-     * (p->offset - q->offset) over all q associations.  The idea is
-     * to repeatedly discard the survivor with maximum selection
-     * jitter until a termination condition is met.
-     */
+     * jitter p->sjitter as the square root of the mean of the
+     * squares (p->offset - q->offset) over all other q associations.
+     * The idea is to repeatedly discard the survivor with maximum
+     * selection jitter until a termination condition is met.
+     *
+     * Each survivor keeps its sum of squares in s.v[].sum.  They
+     * start off from the mean, in one pass: with offsets taken from
+     * the mean, the sum for p is n times its own square plus the sum
+     * of all the squares.  When a survivor is discarded, its term is
+     * taken off the sums of the others, so a round costs a pass over
+     * the survivors rather than a pass for each of them.  Taking off
+     * a term can leave a tiny negative sum through rounding when the
+     * offsets are close together, so a sum goes no lower than zero.
+     */
+    mean = 0;
+    for (i = 0; i < s.n; i++)
+        mean += s.v[i].offset;
+    mean /= s.n;
+    dtemp = 0;
+    for (i = 0; i < s.n; i++)
+        dtemp += SQUARE(s.v[i].offset - mean);
+    for (i = 0; i < s.n; i++)
+        s.v[i].sum = s.n * SQUARE(s.v[i].offset - mean) + dtemp;
+
     while (1)
     {
-        struct p *p, *q, *qmax; /* peer structure pointers */
-        double max, min, dtemp;
+        double max, min; /* max selection jitter, min peer jitter */
+        int qmax;        /* survivor with max selection jitter */
 
         max = -2e9;
         min = 2e9;
+        qmax = 0;
         for (i = 0; i < s.n; i++)
         {
-            p = s.v[i].p;
-            if (p->jitter < min)
-                min = p->jitter;
-            dtemp = 0;
-            for (j = 0; j < n; j++)
-            {
-                q = s.v[j].p;
-                dtemp += SQUARE(p->offset - q->offset);
-            }
-            dtemp = SQRT(dtemp);
-            if (dtemp > max)
+            if (hot.jitter[s.v[i].p->h] < min)
+                min = hot.jitter[s.v[i].p->h];
+            if (s.v[i].sum > max)
             {
-                max = dtemp;
-                qmax = q;
+                max = s.v[i].sum;
+                qmax = i;
             }
         }
+        if (s.n > 1)
+            max = SQRT(max / (s.n - 1));
 
         /*
          * If the maximum selection jitter is less than the
@@ -799,14 +1430,19 @@ void clock_select()
          * if the number of survivors is less than or equal to
          * NMIN (3).
          */
-        if (max < min || n <= NMIN)
+        if (max < min || s.n <= NMIN)
             break;
 
         /*
-         * Delete survivor qmax from the list and go around
-         * again.
+         * Delete survivor qmax from the list, keeping the rest in
+         * order, and go around again.
          */
+        dtemp = s.v[qmax].offset;
+        for (i = qmax; i < s.n - 1; i++)
+            s.v[i] = s.v[i + 1];
         s.n--;
+        for (i = 0; i < s.n; i++)
+            s.v[i].sum = max(s.v[i].sum - SQUARE(s.v[i].offset - dtemp), 0);
     }
 
     /*
@@ -815,10 +1451,13 @@ void clock_select()
      * then don't do a clock hop.  Otherwise, select the first
      * survivor on the list as the new system peer.
      */
-    if (osys->stratum == s.v[0].p->stratum)
-        s.p = osys;
-    else
-        s.p = s.v[0].p;
+    s.p = s.v[0].p;
+    for (i = 0; i < s.n; i++)
+    {
+        if (s.v[i].p == osys &&
+            hot.stratum[osys->h] == hot.stratum[s.v[0].p->h])
+            s.p = osys;
+    }
     clock_update(s.p);
 }
 
@@ -828,15 +1467,25 @@ void clock_select()
 double
 root_dist(struct p *p /* peer structure pointer */)
 {
+    int i;
 
     /*
      * The root synchronization distance is the maximum error due to
      * all causes of the local clock relative to the primary server.
      * It is defined as half the total delay plus total dispersion
-     * plus peer jitter.
+     * plus peer jitter.  It is computed at most once a second; the
+     * routines that change the variables it depends on mark it out
+     * of date.
      */
-    return (max(MINDISP, p->rootdelay + p->delay) / 2 +
-            p->rootdisp + p->disp + PHI * (c.t - p->t) + p->jitter);
+    i = p->h;
+    if (hot.distt[i] != c.t)
+    {
+        hot.dist[i] = max(MINDISP, hot.rootdelay[i] + hot.delay[i]) / 2 +
+                      hot.rootdisp[i] + hot.disp[i] + PHI * (c.t - hot.t[i]) +
+                      hot.jitter[i];
+        hot.distt[i] = c.t;
+    }
+    return (hot.dist[i]);
 }
 
 /*
@@ -848,7 +1497,7 @@ int accept(struct p *p /* peer structure pointer */)
      * A stratum error occurs if (1) the server has never been
      * synchronized, (2) the server stratum is invalid.
      */
-    if (p->leap == NOSYNC || p->stratum >= MAXSTRAT)
+    if (p->leap == NOSYNC || hot.stratum[p->h] >= MAXSTRAT)
         return (FALSE);
 
     /*
@@ -882,6 +1531,7 @@ int accept(struct p *p /* peer structure pointer */)
  */
 void clock_update(struct p *p /* peer structure pointer */)
 {
+    struct p *q; /* next association */
     double dtemp;
 
     /*
@@ -889,14 +1539,14 @@ void clock_update(struct p *p /* peer structure pointer */)
      * system peer change, avoid it.  We never use an old sample or
      * the same sample twice.
      */
-    if (s.t >= p->t)
+    if (s.t >= hot.t[p->h])
         return;
 
     /*
      * Combine the survivor offsets and update the system clock; the
      * local_clock() routine will tell us the good or bad news.
      */
-    s.t = p->t;
+    s.t = hot.t[p->h];
     clock_combine();
     switch (local_clock(p, s.offset))
     {
@@ -921,9 +1571,14 @@ void clock_update(struct p *p /* peer structure pointer */)
      * site.
      */
     case STEP:
-        while (/* all associations */ 0)
+        for (p = assoc; p != NULL; p = q)
+        {
+            q = p->next;
             clear(p, X_STEP);
+        }
+        S_BEGIN();
         s.stratum = MAXSTRAT;
+        S_END();
         s.poll = MINPOLL;
         break;
 
@@ -936,16 +1591,18 @@ void clock_update(struct p *p /* peer structure pointer */)
      * default .01 s in the reference implementation.
      */
     case SLEW:
+        dtemp = SQRT(SQUARE(hot.jitter[p->h]) + SQUARE(s.jitter));
+        dtemp += max(hot.disp[p->h] + PHI * (c.t - hot.t[p->h]) +
+                         fabs(hot.offset[p->h]),
+                     MINDISP);
+        S_BEGIN();
         s.leap = p->leap;
-        s.stratum = p->stratum + 1;
+        s.stratum = hot.stratum[p->h] + 1;
         s.refid = p->refid;
         s.reftime = p->reftime;
-        s.rootdelay = p->rootdelay + p->delay;
-        dtemp = SQRT(SQUARE(p->jitter) + SQUARE(s.jitter));
-        dtemp += max(p->disp + PHI * (c.t - p->t) +
-                         fabs(p->offset),
-                     MINDISP);
-        s.rootdisp = p->rootdisp + dtemp;
+        s.rootdelay = hot.rootdelay[p->h] + hot.delay[p->h];
+        s.rootdisp = hot.rootdisp[p->h] + dtemp;
+        S_END();
         break;
     /*
      * Some samples are discarded while, for instance, a direct
@@ -959,11 +1616,13 @@ void clock_update(struct p *p /* peer structure pointer */)
 /*
  * clock_combine() - combine offsets
  */
+#define NLANE 4 /* sums kept apart */
+
 void clock_combine()
 {
-    struct p *p; /* peer structure pointer */
-    double x, y, z, w;
-    int i;
+    double y[NLANE], z[NLANE], w[NLANE]; /* partial sums */
+    double x, o0;
+    int i, j;
 
     /*
      * Combine the offsets of the clustering algorithm survivors
@@ -975,18 +1634,40 @@ void clock_combine()
      * clockhopping is involved.  The reference implementation can
      * be configured to avoid this algorithm by designating a
      * preferred peer.
-     */
-    y = z = w = 0;
-    for (i = 0; s.v[i].p != NULL; i++)
+     *
+     * The survivor list has the offsets and root distances from the
+     * selection just made.  The sums are kept in NLANE lanes, each
+     * taking every NLANE-th survivor, so the additions do not wait
+     * on each other and the compiler can do the lanes in one vector.
+     */
+    o0 = s.v[0].offset;
+    for (j = 0; j < NLANE; j++)
+        y[j] = z[j] = w[j] = 0;
+    for (i = 0; i + NLANE <= s.n; i += NLANE)
+    {
+        for (j = 0; j < NLANE; j++)
+        {
+            x = 1 / s.v[i + j].dist;
+            y[j] += x;
+            z[j] += s.v[i + j].offset * x;
+            w[j] += SQUARE(s.v[i + j].offset - o0) * x;
+        }
+    }
+    for (j = 0; i < s.n; i++, j++)
+    {
+        x = 1 / s.v[i].dist;
+        y[j] += x;
+        z[j] += s.v[i].offset * x;
+        w[j] += SQUARE(s.v[i].offset - o0) * x;
+    }
+    for (j = 1; j < NLANE; j++)
     {
-        p = s.v[i].p;
-        x = root_dist(p);
-        y += 1 / x;
-        z += p->offset / x;
-        w += SQUARE(p->offset - s.v[0].p->offset) / x;
+        y[0] += y[j];
+        z[0] += z[j];
+        w[0] += w[j];
     }
-    s.offset = z / y;
-    s.jitter = SQRT(w / y);
+    s.offset = z[0] / y[0];
+    s.jitter = SQRT(w[0] / y[0]);
 }
 
 /*
@@ -995,7 +1676,7 @@ void clock_combine()
 #define STEPT .128      /* step threshold (s) */
 #define WATCH 900       /* stepout threshold (s) */
 #define PANICT 1000     /* panic threshold (s) */
-#define PLL 65536       /* PLL loop gain */
+#define PLL 16          /* PLL loop gain */
 #define FLL MAXPOLL + 1 /* FLL loop gain */
 #define AVG 4           /* parameter averaging constant */
 #define ALLAN 1500      /* compromise Allan intercept (s) */
@@ -1012,7 +1693,6 @@ local_clock(
     double offset /* clock offset from combine() */
 )
 {
-    int state;   /* clock discipline state */
     double freq; /* frequency */
     double mu;   /* interval since last update */
     int rval;
@@ -1031,7 +1711,7 @@ local_clock(
      * offset exceeds the step threshold and when it does not.
      */
     rval = SLEW;
-    mu = p->t - s.t;
+    mu = hot.t[p->h] - c.epoch;
     freq = 0;
     if (fabs(offset) > STEPT)
     {
@@ -1042,8 +1722,8 @@ local_clock(
          * switch to S_SPIK state.
          */
         case SYNC:
-            state = SPIK;
-            return (rval);
+            c.state = SPIK;
+            return (IGNORE);
 
         /*
          * In S_FREQ state, we ignore outliers and inliers.  At
@@ -1056,7 +1736,7 @@ local_clock(
                 return (IGNORE);
 
             freq = (offset - c.offset) / mu;
-            /* fall through to S_SPIK */
+            /* fall through */
 
         /*
          * In S_SPIK state, we ignore succeeding outliers until
@@ -1067,7 +1747,7 @@ local_clock(
             if (mu < WATCH)
                 return (IGNORE);
 
-            /* fall through to default */
+            /* fall through */
 
         /*
          * We get here by default in S_NSET and S_FSET states
@@ -1104,14 +1784,14 @@ local_clock(
             c.count = 0;
             s.poll = MINPOLL;
             rval = STEP;
-            if (state == NSET)
+            if (c.state == NSET)
             {
-                rstclock(FREQ, p->t, 0);
+                rstclock(FREQ, hot.t[p->h], 0);
                 return (rval);
             }
             break;
         }
-        rstclock(SYNC, p->t, 0);
+        rstclock(SYNC, hot.t[p->h], 0);
     }
     else
     {
@@ -1135,7 +1815,7 @@ local_clock(
          * frequency.
          */
         case NSET:
-            rstclock(FREQ, p->t, offset);
+            rstclock(FREQ, hot.t[p->h], offset);
             return (IGNORE);
 
         /*
@@ -1144,7 +1824,7 @@ local_clock(
          * but don't adjust the frequency until the next update.
          */
         case FSET:
-            rstclock(SYNC, p->t, offset);
+            rstclock(SYNC, hot.t[p->h], offset);
             break;
 
         /*
@@ -1153,10 +1833,11 @@ local_clock(
          * frequency and switch to S_SYNC state.
          */
         case FREQ:
-            if (c.t - s.t < WATCH)
+            if (mu < WATCH)
                 return (IGNORE);
 
             freq = (offset - c.offset) / mu;
+            rstclock(SYNC, hot.t[p->h], offset);
             break;
 
         /*
@@ -1192,7 +1873,7 @@ local_clock(
             etemp = min(mu, LOG2D(s.poll));
             dtemp = 4 * PLL * LOG2D(s.poll);
             freq += offset * etemp / (dtemp * dtemp);
-            rstclock(SYNC, p->t, offset);
+            rstclock(SYNC, hot.t[p->h], offset);
             break;
         }
     }
@@ -1215,7 +1896,10 @@ local_clock(
      * offset with the clock jitter.  If the offset is less than the
      * clock jitter times a constant, then the averaging interval is
      * increased; otherwise, it is decreased.  A bit of hysteresis
-     * helps calm the dance.  Works best using burst mode.
+     * helps calm the dance.  Works best using burst mode.  The
+     * interval goes no higher than MAXDPOLL, since the jitter tells
+     * nothing of the oscillator wander a longer one would let build
+     * up.
      */
     if (fabs(c.offset) < PGATE * c.jitter)
     {
@@ -1223,7 +1907,7 @@ local_clock(
         if (c.count > LIMIT)
         {
             c.count = LIMIT;
-            if (s.poll < MAXPOLL)
+            if (s.poll < MAXDPOLL)
             {
                 c.count = 0;
                 s.poll++;
@@ -1251,8 +1935,8 @@ local_clock(
  */
 void rstclock(
     int state,     /* new state */
-    double offset, /* new offset */
-    double t       /* new update time */
+    double t,      /* new update time */
+    double offset  /* new offset */
 )
 {
     /*
@@ -1262,7 +1946,7 @@ void rstclock(
      */
     c.state = state;
     c.last = c.offset = offset;
-    s.t = t;
+    c.epoch = s.t = t;
 }
 
 /*
@@ -1281,7 +1965,9 @@ void clock_adjust()
      * synchronization.
      */
     c.t++;
+    S_BEGIN();
     s.rootdisp += PHI;
+    S_END();
 
     /*
      * Implement the phase and frequency adjustments.  The gain
@@ -1301,15 +1987,30 @@ void clock_adjust()
 
     /*
      * Peer timer.  Call the poll() routine when the poll timer
-     * expires.
+     * expires.  The timer wheel hands over only the associations
+     * that are due.
      */
-    while (/* all associations */ 0)
-    {
-        struct p *p; /* dummy peer structure pointer */
+    timer_run(c.t);
+    xmit_flush();
 
-        if (c.t >= p->nextdate)
-            poll(p);
-    }
+    /*
+     * Run the selection put off by clock_filter().
+     */
+    if (s.pending)
+        clock_select();
+
+    /*
+     * Every NTSROT seconds, make a new NTS master key.
+     */
+    if (c.t % NTSROT == 0)
+        nts_rotate();
+
+    /*
+     * Free the key sets and access control tables replaced since,
+     * once no thread can see them.
+     */
+    key_reclaim();
+    acl_reclaim();
 
     /*
      * Once per hour, write the clock frequency to a file.
@@ -1392,7 +2093,16 @@ void poll(struct p *p /* peer structure pointer */)
         p->outdate = c.t;
         p->reach = p->reach << 1;
         if (!(p->reach & 0x7))
+        {
+            /*
+             * The update can select, step the clock and so
+             * release every ephemeral association, this one
+             * included.
+             */
             clock_filter(p, 0, 0, MAXDISP);
+            if (p->hmode == M_RSVD)
+                return;
+        }
         if (!p->reach)
         {
 
@@ -1438,10 +2148,13 @@ void poll(struct p *p /* peer structure pointer */)
         p->burst--;
     }
     /*
-     * Do not transmit if in broadcast client mode.
+     * Do not transmit if in broadcast client mode.  An ephemeral
+     * association whose key has gone is released by peer_xmit().
      */
     if (p->hmode != M_BCLN)
         peer_xmit(p);
+    if (p->hmode == M_RSVD)
+        return;
     poll_update(p, hpoll);
 }
 
@@ -1471,10 +2184,15 @@ void poll_update(
     p->hpoll = max(min(MAXPOLL, poll), MINPOLL);
     if (p->burst > 0)
     {
-        if (p->nextdate != c.t)
+        if ((int)(p->nextdate - c.t) != 0)
+        {
+            timer_arm(p);
             return;
+        }
         else
+        {
             p->nextdate += BTIME;
+        }
     }
     else
     {
@@ -1489,10 +2207,12 @@ void poll_update(
 
     /*
      * It might happen that the due time has already passed.  If so,
-     * make it one second in the future.
+     * make it one second in the future.  The times are in seconds
+     * and compared by their difference, as the timer wheel does.
      */
-    if (p->nextdate <= c.t)
+    if ((int)(p->nextdate - c.t) <= 0)
         p->nextdate = c.t + 1;
+    timer_arm(p);
 }
 
 /*
@@ -1500,30 +2220,50 @@ void poll_update(
  */
 void peer_xmit(struct p *p /* peer structure pointer */)
 {
-    struct x x; /* transmit packet */
+    struct x x;    /* transmit packet */
+    struct key *k; /* association key */
 
     /*
      * Initialize header and transmit timestamp
      */
     x.srcaddr = p->dstaddr;
     x.dstaddr = p->srcaddr;
-    x.leap = s.leap;
+    x.dstport = PORT;
     x.version = p->version;
     x.mode = p->hmode;
-    if (s.stratum == MAXSTRAT)
-        x.stratum = 0;
-    else
-        x.stratum = s.stratum;
     x.poll = p->hpoll;
-    x.precision = s.precision;
-    x.rootdelay = D2FP(s.rootdelay);
-    x.rootdisp = D2FP(s.rootdisp);
-    x.refid = s.refid;
-    x.reftime = s.reftime;
+    x.hdr = s.hdr;
+    x.nts = NULL;
     x.org = p->org;
     x.rec = p->rec;
-    x.xmt = get_time();
+
+    /*
+     * With P_XSTAMP, ask the kernel when the packet actually left.
+     * The transmit timestamp goes out as read here, since it is what
+     * the server echoes and the reply is matched on; packet() puts
+     * the departure time in its place when it computes the sample.
+     *
+     * With P_XLEAVE a symmetric association sends in interleaved
+     * mode once it has heard from the peer and the kernel has
+     * reported when the last packet left: the transmit timestamp is
+     * that departure time and the origin timestamp is the receive
+     * timestamp of the peer, which marks the packet as interleaved.
+     * A departure time equal to the transmit timestamp could not be
+     * told apart from it, so the packet then goes in basic mode.
+     * Server replies are stateless and never interleaved, so for a
+     * client P_XLEAVE is the same as P_XSTAMP.
+     */
+    x.xmt = 0;
+    if (p->flags & P_XLEAVE && p->prec != 0 &&
+        (p->hmode == M_SACT || p->hmode == M_PASV))
+        x.xmt = xmit_stamp(p->xmt);
+    p->xleave = x.xmt != 0 && x.xmt != p->xmt;
+    if (p->xleave)
+        x.org = p->prec;
+    else
+        x.xmt = get_time();
     p->xmt = x.xmt;
+    x.stamp = (p->flags & (P_XSTAMP | P_XLEAVE)) != 0;
 
     /*
      * If the key ID is nonzero, send a valid MAC using the key ID
@@ -1532,12 +2272,17 @@ void peer_xmit(struct p *p /* peer structure pointer */)
      * packet; just reset the association and stop until the problem
      * is fixed.
      */
+    x.maclen = 0;
     if (p->keyid)
-        if (/* p->keyid invalid */ 0)
+    {
+        k = key_lookup(p->keyid);
+        if (k == NULL || !k->trusted)
         {
             clear(p, X_NKEY);
             return;
         }
-    x.dgst = md5(p->keyid);
+        x.maclen = 20;
+        x.keyid = p->keyid;
+    }
     xmit_packet(&x);
 }
@@ -0,0 +1,730 @@
+#include "global.c";
+#include <arpa/inet.h> /* for htonl() */
+#include <stdio.h>     /* for printf() */
+#include <time.h>      /* for clock_gettime() */
+
+/*
+ * Discrete-event simulator.  This takes the place of sysclock.c and
+ * kernel-io.c, so the rest of the program runs unchanged against a
+ * simulated system clock and a simulated network of servers, in
+ * simulated time.  Build with SIM defined and this file in the place of
+ * those two:
+ *
+ *     cc -fcommon -DSIM -o sim sim.c main.c peer.c timer.c wire.c \
+ *         acl.c mac.c md5.c cmac.c keys.c nts.c -lm -lpthread
+ *
+ * The local clock is an oscillator with a frequency error that wanders
+ * as a random walk.  get_time() reads it, step_time() steps it and
+ * adjust_time() slews it at most SLEWMAX, as adjtime() does.  Each
+ * server has its own clock error, roundtrip delay, delay asymmetry,
+ * queueing jitter and loss.  Client requests sent by xmit_packet() are
+ * answered by the server they are addressed to and the replies come
+ * back through recv_batch() as they would from the kernel.
+ *
+ * Nothing happens between events, so the simulation goes from one to
+ * the next as fast as the program can process them: a week of
+ * protocol time takes well under a second.  Events are kept in a
+ * binary heap by time, ties going in the order queued.  All randomness
+ * comes from one generator seeded from SIMSEED, as does random() for
+ * the program, so a run is repeated exactly by its seed.  The run
+ * length in days is taken from SIMDAYS and, if SIMTRACE is set, the
+ * clock state is printed every SIMTRACE seconds.  At the end the
+ * offset, jitter and convergence statistics are printed and the
+ * program exits.
+ *
+ * The network and oscillator are chosen at run time.  SIMCASE names
+ * one of the scenarios below, SIMFREQ (ppm) and SIMWANDER override
+ * its oscillator, and SIMSERVERS replaces its servers with a list of
+ * entries separated by semicolons, each one
+ *
+ *     refid,stratum,offset,delay,asym,jitter,loss,rootdisp
+ *
+ * with the fields as in struct server below.
+ */
+#define SEED 1              /* % default seed */
+#define DAYS 7              /* % default run length (d) */
+#define WARMUP 86400        /* % time before statistics are kept (s) */
+#define SETTLE 1e-3         /* % offset deemed converged (s) */
+#define EPOCH 3950000000ULL /* start of simulation (NTP s) */
+#define FREQERR 15          /* % oscillator frequency error (ppm) */
+#define SLEWMAX 500e-6      /* adjtime() slew rate */
+#define SIMNET 0x0a000000   /* simulated network (10.0.0.0/8) */
+#define NEV 256             /* most events pending */
+#define NSERVER 16          /* most simulated servers */
+
+/*
+ * Simulated servers.  The asymmetry is the share of the roundtrip
+ * delay taken on the way out, less one half, and shows up as an
+ * offset error of asymmetry times delay that no client can remove;
+ * the jitter is the mean of an exponential queueing delay added each
+ * way; the loss is the chance that a packet is lost each way.  The
+ * last one here is a falseticker.
+ */
+struct server
+{
+  ipaddr addr;     /* address (set at start) */
+  char refid[5];   /* reference ID */
+  int stratum;     /* stratum */
+  double offset;   /* clock error (s) */
+  double delay;    /* roundtrip delay (s) */
+  double asym;     /* delay asymmetry */
+  double jitter;   /* mean queueing delay (s) */
+  double loss;     /* packet loss probability */
+  double rootdisp; /* root dispersion (s) */
+};
+
+static struct server quiet[] = {
+    {0, "GPS", 1, 0, 12e-3, 0, 200e-6, .01, 1e-4},
+    {0, "PPS", 1, 0, 25e-3, .01, 500e-6, .02, 1e-4},
+    {0, "GAL", 1, 0, 40e-3, -.01, 1e-3, .02, 2e-4},
+    {0, "DCF", 1, 0, 60e-3, .01, 2e-3, .05, 5e-4},
+    {0, "BAD", 1, 1, 30e-3, 0, 500e-6, .01, 1e-4},
+    {0},
+};
+
+static struct server hard[] = {
+    {0, "GPS", 1, 0, 12e-3, 0, 200e-6, .01, 1e-4},
+    {0, "PPS", 1, 0, 25e-3, .05, 500e-6, .02, 1e-4},
+    {0, "GAL", 1, 0, 40e-3, -.05, 1e-3, .02, 2e-4},
+    {0, "DCF", 1, 0, 60e-3, .1, 2e-3, .05, 5e-4},
+    {0, "BAD", 1, 1, 30e-3, 0, 500e-6, .01, 1e-4},
+    {0},
+};
+
+/*
+ * Scenarios.  The wander is the frequency random walk per root
+ * second.  On "quiet", the default, the asymmetries are small and the
+ * oscillator steady enough for a client to settle within SETTLE, so
+ * a run measures the loop.  "hard" is the network the simulator
+ * first had: asymmetries that put PPS, GAL and DCF 1.25 ms, -2 ms and
+ * 6 ms off, and a walk that moves the frequency about 0.3 ppm a day.
+ * No client settles within SETTLE on it, but it is kept as a
+ * regression case: a run must not step or lose its system peer.
+ */
+struct simcase
+{
+  char *name;            /* SIMCASE value */
+  double wander;         /* frequency random walk (per root s) */
+  struct server *server; /* servers, ending with an empty one */
+};
+
+static struct simcase simcase[] = {
+    {"quiet", 1e-10, quiet},
+    {"hard", 1e-9, hard},
+};
+
+#define NSIMCASE (int)(sizeof(simcase) / sizeof(simcase[0]))
+
+static struct server server[NSERVER]; /* servers in use */
+static int nserver;                   /* number of servers */
+
+/*
+ * Event types
+ */
+#define E_TICK 0   /* one-second timer */
+#define E_SERVER 1 /* request reaches server */
+#define E_CLIENT 2 /* reply reaches client */
+
+/*
+ * Event.  The queue holds pointers, so an event with a packet is not
+ * copied as the heap moves it.
+ */
+struct ev
+{
+  double t;                   /* true time (s from start) */
+  unsigned long seq;          /* order queued */
+  int type;                   /* event type */
+  struct server *sv;          /* server or NULL */
+  int len;                    /* packet length (octets) */
+  unsigned char buf[LEN_BUF]; /* packet */
+  struct ev *next;            /* next free */
+};
+
+static struct ev evpool[NEV];   /* events */
+static struct ev *evfree;       /* free events */
+static struct ev *heap[NEV];    /* event queue */
+static int nheap;               /* events queued */
+static unsigned long evseq;     /* events queued ever */
+static struct r rpkt[NBATCH];   /* packets arrived */
+static int rnext, rcount;       /* recv_packet() cursor */
+static ipaddr laddr;            /* local address */
+
+/*
+ * Simulation state.  Theta is the local clock less true time.
+ */
+struct sim
+{
+  unsigned long long rng; /* generator state */
+  double t;               /* true time (s from start) */
+  double theta;           /* local clock error (s) */
+  double freq;            /* oscillator frequency error */
+  double adj;             /* slew outstanding (s) */
+  double wander;          /* frequency random walk (per root s) */
+  char *net;              /* scenario name */
+  double end;             /* end of run (s) */
+  int trace;              /* trace interval (s) or 0 */
+
+  /*
+   * Statistics
+   */
+  long nsent;      /* requests sent */
+  long nlost;      /* packets lost */
+  long nrecv;      /* replies received */
+  int nstep;       /* clock steps */
+  long nstat;      /* ticks counted */
+  double sum;      /* sum of offsets */
+  double sumsq;    /* sum of squared offsets */
+  double max;      /* largest offset */
+  double fsumsq;   /* sum of squared frequency errors */
+  double settle;   /* last time offset above SETTLE (s) */
+} sim;
+
+/*
+ * sim_random() - uniform random number in (0, 1)
+ *
+ * SplitMix64, which is small, fast and the same everywhere.
+ */
+static double
+sim_random()
+{
+    unsigned long long z;
+
+    z = (sim.rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (((z >> 11) + .5) / 9007199254740992.);
+}
+
+/*
+ * sim_gauss() - normal random number, mean 0 and variance 1
+ */
+static double
+sim_gauss()
+{
+    return (sqrt(-2 * log(sim_random())) *
+            cos(2 * M_PI * sim_random()));
+}
+
+/*
+ * sim_expo() - exponential random number
+ */
+static double
+sim_expo(double mean /* mean */)
+{
+    return (-mean * log(sim_random()));
+}
+
+/*
+ * ev_alloc() - allocate event
+ */
+static struct ev * /* event or NULL if none free */
+ev_alloc()
+{
+    struct ev *ev;
+
+    ev = evfree;
+    if (ev != NULL)
+        evfree = ev->next;
+    return (ev);
+}
+
+/*
+ * ev_push() - queue event at time t
+ */
+static void ev_push(
+    struct ev *ev, /* event */
+    double t       /* true time (s from start) */
+)
+{
+    struct ev *up;
+    int i;
+
+    ev->t = t;
+    ev->seq = evseq++;
+    for (i = nheap++; i > 0; i = (i - 1) / 2)
+    {
+        up = heap[(i - 1) / 2];
+        if (up->t < t || (up->t == t && up->seq < ev->seq))
+            break;
+
+        heap[i] = up;
+    }
+    heap[i] = ev;
+}
+
+/*
+ * ev_pop() - dequeue the earliest event
+ */
+static struct ev * /* event */
+ev_pop()
+{
+    struct ev *ev, *last, *q;
+    int i, j;
+
+    ev = heap[0];
+    last = heap[--nheap];
+    for (i = 0; (j = 2 * i + 1) < nheap; i = j)
+    {
+        if (j + 1 < nheap && (heap[j + 1]->t < heap[j]->t ||
+                              (heap[j + 1]->t == heap[j]->t &&
+                               heap[j + 1]->seq < heap[j]->seq)))
+            j++;
+        q = heap[j];
+        if (last->t < q->t || (last->t == q->t && last->seq < q->seq))
+            break;
+
+        heap[i] = q;
+    }
+    heap[i] = last;
+    return (ev);
+}
+
+/*
+ * sim_stamp() - NTP timestamp of a clock reading
+ */
+static tstamp /* NTP timestamp */
+sim_stamp(double t /* seconds from start */)
+{
+    return ((EPOCH << 32) + d_lfp(t));
+}
+
+/*
+ * sim_advance() - run the oscillator forward to true time t
+ *
+ * The clock gains the frequency error and whatever slew is
+ * outstanding, at no more than SLEWMAX.
+ */
+static void
+sim_advance(double t /* true time (s from start) */)
+{
+    double dt, slew;
+
+    dt = t - sim.t;
+    slew = min(fabs(sim.adj), SLEWMAX * dt);
+    if (sim.adj < 0)
+        slew = -slew;
+    sim.theta += sim.freq * dt + slew;
+    sim.adj -= slew;
+    sim.t = t;
+}
+
+/*
+ * get_time - read system time and convert to NTP format
+ */
+tstamp get_time()
+{
+    return (sim_stamp(sim.t + sim.theta));
+}
+
+/*
+ * step_time() - step system time to given offset value
+ */
+void step_time(double offset /* clock offset */)
+{
+    sim.theta += offset;
+    sim.nstep++;
+}
+
+/*
+ * adjust_time() - slew system clock to given offset value
+ *
+ * As with adjtime(), a new adjustment replaces what is left of the
+ * old one.
+ */
+void adjust_time(double offset /* clock offset */)
+{
+    sim.adj = offset;
+}
+
+/*
+ * io_open - open the NTP socket
+ *
+ * The simulated host has the one address laddr and no other threads
+ * to share the port with, so there is nothing to open.
+ */
+int /* socket descriptor */
+io_open(
+    ipaddr addr, /* local address (not used) */
+    int reuse    /* not used */
+)
+{
+    (void)addr;
+    (void)reuse;
+    return (0);
+}
+
+/*
+ * recv_batch - receive batch of packets from network
+ *
+ * Return the packets that have arrived since the last call.
+ */
+int /* number of packets */
+recv_batch(struct r **rv /* receive vector pointer */)
+{
+    int n;
+
+    n = rcount;
+    rcount = 0;
+    rnext = 0;
+    *rv = rpkt;
+    return (n);
+}
+
+/*
+ * recv_packet - receive packet from network
+ *
+ * The simulated network does not wait, so with nothing arrived there
+ * is no packet.
+ */
+struct r /* receive packet pointer or NULL */
+    *
+    recv_packet()
+{
+    if (rnext >= rcount)
+        return (NULL);
+
+    return (&rpkt[rnext++]);
+}
+
+/*
+ * xmit_packet - transmit packet to network
+ *
+ * The packet goes to the server it is addressed to, if there is one
+ * and it is not lost on the way.
+ */
+void xmit_packet(struct x *x /* transmit packet pointer */)
+{
+    struct server *sv;
+    struct ev *ev;
+
+    for (sv = server; sv < server + nserver; sv++)
+    {
+        if (sv->addr == x->dstaddr)
+            break;
+    }
+    if (sv == server + nserver || x->mode != M_CLNT)
+        return;
+
+    sim.nsent++;
+    if (sim_random() < sv->loss || (ev = ev_alloc()) == NULL)
+    {
+        sim.nlost++;
+        return;
+    }
+    ev->type = E_SERVER;
+    ev->sv = sv;
+    ev->len = encode_packet(x, ev->buf);
+    ev_push(ev, sim.t + sv->delay * (.5 + sv->asym) +
+                    sim_expo(sv->jitter));
+}
+
+/*
+ * xmit_flush - send all queued packets
+ *
+ * Packets are not queued here.
+ */
+void xmit_flush()
+{
+}
+
+/*
+ * xmit_stamp - look up kernel transmit timestamp
+ *
+ * A simulated packet leaves as it is stamped.
+ */
+tstamp /* NTP timestamp */
+xmit_stamp(tstamp xmt /* transmit timestamp in packet */)
+{
+    return (xmt);
+}
+
+/*
+ * sim_serve() - answer request at the server
+ *
+ * The server strikes its receive and transmit timestamps by its own
+ * clock as the request arrives and sends the reply in the same event.
+ */
+static void
+sim_serve(struct ev *ev /* request event */)
+{
+    struct server *sv = ev->sv;
+    struct r r;
+    struct x x;
+
+    if (!decode_packet(&r, ev->buf, ev->len) ||
+        sim_random() < sv->loss)
+    {
+        sim.nlost++;
+        ev->next = evfree;
+        evfree = ev;
+        return;
+    }
+    memset(&x, 0, sizeof(x));
+    x.version = r.version;
+    x.leap = 0;
+    x.mode = M_SERV;
+    x.stratum = sv->stratum;
+    x.poll = r.poll;
+    x.precision = -20;
+    x.rootdisp = D2FP(sv->rootdisp);
+    memcpy(&x.refid, sv->refid, 4);
+    x.reftime = sim_stamp(floor(ev->t + sv->offset));
+    x.org = r.xmt;
+    x.rec = sim_stamp(ev->t + sv->offset);
+    x.xmt = x.rec;
+    ev->type = E_CLIENT;
+    ev->len = encode_packet(&x, ev->buf);
+    ev_push(ev, ev->t + sv->delay * (.5 - sv->asym) +
+                    sim_expo(sv->jitter));
+}
+
+/*
+ * sim_arrive() - hand reply to the receive path
+ *
+ * A reply that finds the batch full is dropped, as the kernel drops
+ * a packet that finds the socket buffer full, and counts as lost.
+ */
+static void
+sim_arrive(struct ev *ev /* reply event */)
+{
+    struct r *r;
+
+    r = &rpkt[rcount];
+    if (rcount >= NBATCH)
+        sim.nlost++;
+    else if (decode_packet(r, ev->buf, ev->len))
+    {
+        r->srcaddr = ev->sv->addr;
+        r->srcport = 123;
+        r->dstaddr = laddr;
+        r->dst = get_time();
+        rcount++;
+        sim.nrecv++;
+    }
+    ev->next = evfree;
+    evfree = ev;
+}
+
+/*
+ * sim_tick() - one-second timer
+ *
+ * Let the oscillator wander, run the clock discipline and the poll
+ * process, then take the statistics.
+ */
+static void
+sim_tick(struct ev *ev /* timer event */)
+{
+    double fe;
+
+    sim.freq += sim.wander * sim_gauss();
+    clock_adjust();
+
+    fe = c.freq + sim.freq;
+    if (fabs(sim.theta) > SETTLE)
+        sim.settle = sim.t;
+    if (sim.t >= WARMUP)
+    {
+        sim.nstat++;
+        sim.sum += sim.theta;
+        sim.sumsq += SQUARE(sim.theta);
+        sim.max = max(sim.max, fabs(sim.theta));
+        sim.fsumsq += SQUARE(fe);
+    }
+    if (sim.trace > 0 && (long)sim.t % sim.trace == 0)
+        printf("%10.0f %12.6f %10.3f %3d %2d\n", sim.t, sim.theta * 1e3,
+               fe * 1e6, s.poll, s.stratum);
+    ev_push(ev, sim.t + 1);
+}
+
+/*
+ * sim_env() - read number from the environment
+ */
+static long /* value */
+sim_env(
+    char *name, /* variable */
+    long dflt   /* default */
+)
+{
+    char *v;
+
+    v = getenv(name);
+    return (v != NULL ? strtol(v, NULL, 0) : dflt);
+}
+
+/*
+ * sim_envf() - read real number from the environment
+ */
+static double /* value */
+sim_envf(
+    char *name, /* variable */
+    double dflt /* default */
+)
+{
+    char *v;
+
+    v = getenv(name);
+    return (v != NULL ? strtod(v, NULL) : dflt);
+}
+
+/*
+ * sim_network() - set up the scenario
+ *
+ * Take the scenario named by SIMCASE, then the overrides.  A name
+ * or server list that cannot be read ends the run, since the results
+ * would not be for the network asked for.
+ */
+static void
+sim_network()
+{
+    struct simcase *sc;
+    struct server *sv;
+    char *v;
+    int n;
+
+    v = getenv("SIMCASE");
+    for (sc = simcase; sc < simcase + NSIMCASE; sc++)
+    {
+        if (v == NULL || strcmp(v, sc->name) == 0)
+            break;
+    }
+    if (sc == simcase + NSIMCASE)
+    {
+        fprintf(stderr, "sim: no scenario %s\n", v);
+        exit(1);
+    }
+    sim.freq = sim_envf("SIMFREQ", FREQERR) * 1e-6;
+    sim.wander = sim_envf("SIMWANDER", sc->wander);
+    sim.net = sc->name;
+    for (sv = sc->server; sv->refid[0] != '\0'; sv++)
+        server[nserver++] = *sv;
+
+    v = getenv("SIMSERVERS");
+    if (v == NULL)
+        return;
+
+    sim.net = "custom";
+    for (nserver = 0; *v != '\0' && nserver < NSERVER; nserver++)
+    {
+        sv = &server[nserver];
+        memset(sv, 0, sizeof(*sv));
+        if (sscanf(v, " %4[^,;],%d,%lf,%lf,%lf,%lf,%lf,%lf%n",
+                   sv->refid, &sv->stratum, &sv->offset, &sv->delay,
+                   &sv->asym, &sv->jitter, &sv->loss, &sv->rootdisp,
+                   &n) != 8)
+            break;
+
+        v += n;
+        v += strspn(v, "; ");
+    }
+    if (*v != '\0' || nserver == 0)
+    {
+        fprintf(stderr, "sim: bad SIMSERVERS at \"%s\"\n", v);
+        exit(1);
+    }
+}
+
+/*
+ * sim_run() - simulation loop
+ */
+void sim_run()
+{
+    struct timespec w0, w1; /* wall clock */
+    struct pool ps;         /* association pool */
+    struct server *sv;
+    struct ev *ev;
+    struct r *r;
+    double dtemp;
+    int n, i;
+
+    /*
+     * Seed everything from the one seed, set up the network, start
+     * the oscillator off with its frequency error and no offset, and
+     * mobilize a client association for every server.
+     */
+    sim.rng = sim_env("SIMSEED", SEED);
+    srandom(sim.rng);
+    sim.end = 86400. * sim_env("SIMDAYS", DAYS);
+    sim.trace = sim_env("SIMTRACE", 0);
+    sim_network();
+    for (i = NEV - 1; i >= 0; i--)
+    {
+        evpool[i].next = evfree;
+        evfree = &evpool[i];
+    }
+    laddr = htonl(SIMNET + 1);
+    for (i = 0; i < nserver; i++)
+    {
+        server[i].addr = htonl(SIMNET + 101 + i);
+        mobilize(server[i].addr, laddr, VERSION, M_CLNT, 0, P_IBURST);
+    }
+    ev = ev_alloc();
+    ev->type = E_TICK;
+    ev->sv = NULL;
+    ev_push(ev, 1);
+    clock_gettime(CLOCK_MONOTONIC, &w0);
+
+    /*
+     * Take the events in time order and run the receive loop after
+     * each, just as main() does when packets arrive.
+     */
+    while (nheap > 0 && heap[0]->t < sim.end)
+    {
+        ev = ev_pop();
+        sim_advance(ev->t);
+        switch (ev->type)
+        {
+        case E_TICK:
+            sim_tick(ev);
+            break;
+
+        case E_SERVER:
+            sim_serve(ev);
+            break;
+
+        case E_CLIENT:
+            sim_arrive(ev);
+            break;
+        }
+        key_quiesce();
+        n = recv_batch(&r);
+        mac_check(r, n);
+        for (i = 0; i < n; i++)
+            receive(&r[i]);
+        xmit_flush();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w1);
+
+    /*
+     * Report.  The offset is the local clock less true time, taken
+     * once a second after the warmup; the frequency error is what
+     * the discipline leaves of the oscillator error.
+     */
+    dtemp = sim.nstat > 0 ? sim.sum / sim.nstat : 0;
+    printf("seed %llu, %s, %.0f days simulated in %.2f s\n",
+           (unsigned long long)sim_env("SIMSEED", SEED), sim.net,
+           sim.end / 86400,
+           (w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9);
+    printf("packets sent %ld, lost %ld, received %ld\n", sim.nsent,
+           sim.nlost, sim.nrecv);
+    pool_stat(&ps);
+    printf("associations %d, peak %d, slots %d in %d slabs (%d huge), "
+           "refused %d\n",
+           ps.used, ps.peak, ps.total, ps.slabs, ps.huge, ps.fails);
+    printf("steps %d, last offset over %g ms at %.0f s\n", sim.nstep,
+           SETTLE * 1e3, sim.settle);
+    printf("offset mean %.3f us, jitter %.3f us, max %.3f us\n",
+           dtemp * 1e6,
+           SQRT(max(sim.sumsq / max(sim.nstat, 1) - SQUARE(dtemp), 0)) *
+               1e6,
+           sim.max * 1e6);
+    printf("frequency error RMS %.4f ppm, final poll %d, stratum %d\n",
+           SQRT(sim.fsumsq / max(sim.nstat, 1)) * 1e6, s.poll,
+           s.stratum);
+    for (sv = server; sv < server + nserver; sv++)
+    {
+        if (s.p != NULL && s.p->srcaddr == sv->addr)
+            printf("system peer %s\n", sv->refid);
+    }
+    exit(0);
+}
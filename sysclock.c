@@ -10,7 +10,6 @@
  * arguments in floating double.  The simplified code shown here is for
  * illustration only and has not been verified.
  */
-#define JAN_1970 2208988800UL /* 1970 - 1900 in seconds */
 
 /*
  * get_time - read system time and convert to NTP format
@@ -20,10 +19,10 @@ tstamp get_time()
     struct timeval unix_time;
     /*
      * There are only two calls on this routine in the program.  One
-     * when a packet arrives from the network and the other when a
-     * packet is placed on the send queue.  Call the kernel time of
-     * day routine (such as gettimeofday()) and convert to NTP
-     * format.
+     * when a packet arrives from the network without a kernel
+     * receive timestamp and the other when a packet is placed on the
+     * send queue.  Call the kernel time of day routine (such as
+     * gettimeofday()) and convert to NTP format.
      */
     gettimeofday(&unix_time, NULL);
     return (U2LFP(unix_time));
@@ -37,17 +36,24 @@ void step_time(
 )
 {
     struct timeval unix_time;
-    tstamp ntp_time;
+    long long ntp_time;
 
     /*
-         * Convert from double to native format (signed) and add to the
-         * current time.  Note the addition is done in native format to
-         * avoid overflow or loss of precision.
-         */
+     * Convert from double to signed fixed point and add to the
+     * current time.  Note the addition is done in native format to
+     * avoid overflow or loss of precision: the whole seconds go to
+     * the seconds and the fraction, which is never negative, to the
+     * microseconds.
+     */
+    ntp_time = d_lfp(offset);
     gettimeofday(&unix_time, NULL);
-    ntp_time = D2LFP(offset) + U2LFP(unix_time);
-    unix_time.tv_sec = ntp_time >> 32;
-    unix_time.tv_usec = (long)(((ntp_time - unix_time.tv_sec) << 32) / FRAC * 1e6);
+    unix_time.tv_sec += ntp_time >> 32;
+    unix_time.tv_usec += lfp2us(ntp_time);
+    if (unix_time.tv_usec >= 1000000)
+    {
+        unix_time.tv_sec++;
+        unix_time.tv_usec -= 1000000;
+    }
     settimeofday(&unix_time, NULL);
 }
 
@@ -57,13 +63,15 @@ void step_time(
 void adjust_time(double offset /* clock offset */)
 {
     struct timeval unix_time;
-    tstamp ntp_time;
+    long long ntp_time;
+
     /*
-     * Convert from double to native format (signed) and add to the
-     * current time.
+     * Convert from double to signed fixed point and split it into
+     * seconds and a fraction that is never negative, which is how
+     * adjtime() wants a negative adjustment.
      */
-    ntp_time = D2LFP(offset);
+    ntp_time = d_lfp(offset);
     unix_time.tv_sec = ntp_time >> 32;
-    unix_time.tv_usec = (long)(((ntp_time - unix_time.tv_sec) << 32) / FRAC * 1e6);
+    unix_time.tv_usec = lfp2us(ntp_time);
     adjtime(&unix_time, NULL);
-}
\ No newline at end of file
+}
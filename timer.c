@@ -0,0 +1,142 @@
+#include "global.c";
+
+/*
+ * Poll timer wheel.  Instead of clock_adjust() looking at every
+ * association each second, associations wait on a hierarchical timer
+ * wheel keyed on p->nextdate, and each tick takes only those that are
+ * due.  Level 0 has a slot per second for the next 256 seconds; levels
+ * 1 and 2 have 64 slots each of 256 and 16384 seconds, which covers
+ * MAXPOLL (36.4 h) with room to spare.  When level 0 comes round, the
+ * level 1 slot for the next 256 seconds is spread over it, and
+ * likewise level 2 into level 1.
+ *
+ * poll_update() and clear() arm the timer whenever they set
+ * p->nextdate and clear() cancels it before freeing an association.
+ * The links are in the association itself, so arming and cancelling
+ * are O(1) and never allocate.
+ */
+#define W0BITS 8                  /* level 0 slot bits */
+#define WNBITS 6                  /* level 1 and 2 slot bits */
+#define W0 (1 << W0BITS)          /* level 0 slots */
+#define WN (1 << WNBITS)          /* level 1 and 2 slots */
+#define W1SHIFT W0BITS            /* level 1 seconds per slot (log2) */
+#define W2SHIFT (W0BITS + WNBITS) /* level 2 seconds per slot (log2) */
+
+static struct p *wheel0[W0]; /* level 0 slots */
+static struct p *wheel1[WN]; /* level 1 slots */
+static struct p *wheel2[WN]; /* level 2 slots */
+static unsigned int wnow;    /* last tick run */
+
+/*
+ * timer_cancel() - take association off the timer wheel
+ */
+void timer_cancel(struct p *p /* peer structure pointer */)
+{
+    if (p->tprev == NULL)
+        return;
+
+    if (p->tnext != NULL)
+        p->tnext->tprev = p->tprev;
+    *p->tprev = p->tnext;
+    p->tprev = NULL;
+}
+
+/*
+ * timer_arm() - put association on the timer wheel at p->nextdate
+ */
+void timer_arm(struct p *p /* peer structure pointer */)
+{
+    struct p **slot;
+    unsigned int t, delta;
+
+    timer_cancel(p);
+
+    /*
+     * A time already past is due on the next tick.  One too far out
+     * for the wheel waits in the level 2 slot that comes round last
+     * and is placed again from there.
+     */
+    t = p->nextdate;
+    if ((int)(t - wnow) <= 0)
+        t = wnow + 1;
+    delta = t - wnow;
+    if (delta <= W0)
+        slot = &wheel0[t & (W0 - 1)];
+    else if (delta <= 1U << W2SHIFT)
+        slot = &wheel1[(t >> W1SHIFT) & (WN - 1)];
+    else if (delta <= 1U << (W2SHIFT + WNBITS))
+        slot = &wheel2[(t >> W2SHIFT) & (WN - 1)];
+    else
+        slot = &wheel2[(wnow >> W2SHIFT) & (WN - 1)];
+
+    p->tnext = *slot;
+    if (p->tnext != NULL)
+        p->tnext->tprev = &p->tnext;
+    p->tprev = slot;
+    *slot = p;
+}
+
+/*
+ * timer_cascade() - spread a higher level slot over the wheel
+ */
+static void timer_cascade(struct p **slot /* slot to spread */)
+{
+    struct p *p, *q;
+
+    p = *slot;
+    *slot = NULL;
+    for (; p != NULL; p = q)
+    {
+        q = p->tnext;
+        p->tprev = NULL;
+        timer_arm(p);
+    }
+}
+
+/*
+ * timer_run() - poll the associations due up to time t
+ */
+void timer_run(unsigned int t /* current time */)
+{
+    struct p *p, *due; /* association, associations due */
+    unsigned int next; /* tick to run */
+
+    while ((int)(t - wnow) > 0)
+    {
+        /*
+         * Cascade while wnow is still the last tick run, so what
+         * is due on this tick lands in its level 0 slot.
+         */
+        next = wnow + 1;
+        if ((next & (W0 - 1)) == 0)
+        {
+            if (((next >> W1SHIFT) & (WN - 1)) == 0)
+                timer_cascade(&wheel2[(next >> W2SHIFT) & (WN - 1)]);
+            timer_cascade(&wheel1[(next >> W1SHIFT) & (WN - 1)]);
+        }
+        wnow = next;
+
+        /*
+         * Take the whole slot first.  poll() arms the association
+         * again through poll_update(), possibly into this very slot
+         * if it is due a full turn later.  The slot is moved to a
+         * list of its own rather than walked by next pointer, since
+         * poll() can step the clock and clear() then frees or arms
+         * any association, including the ones still due.  Those
+         * leave the list through timer_cancel(), so the head is
+         * always the next one to run.
+         */
+        due = wheel0[wnow & (W0 - 1)];
+        wheel0[wnow & (W0 - 1)] = NULL;
+        if (due != NULL)
+            due->tprev = &due;
+        while ((p = due) != NULL)
+        {
+            timer_cancel(p);
+            if ((int)(p->nextdate - wnow) <= 0)
+                poll(p);
+            else
+                timer_arm(p);
+        }
+    }
+}
@@ -0,0 +1,282 @@
+#include "global.c";
+#include <liburing.h>   /* for io_uring and friends */
+#include <netinet/in.h> /* for sockaddr_in */
+#include <stdio.h>      /* for fprintf() */
+
+/*
+ * io_uring engine.  This is an alternative to the recv_batch() loop in
+ * main() for Linux systems with io_uring, selected at compile time
+ * with URING.  A single ring carries everything the program does:
+ *
+ * - One multishot recvmsg() that stays armed and posts a completion
+ *   for every arriving packet.  The kernel picks a buffer for each
+ *   packet from a ring of provided buffers, so there is no receive
+ *   submission per packet.
+ * - The packets sent by fast_xmit() and peer_xmit().  xmit_packet()
+ *   hands them to uring_xmit(), which only fills in a submission
+ *   queue entry.
+ * - A multishot one-second timeout that runs clock_adjust(), so no
+ *   separate timer is needed.
+ *
+ * All submissions queued while a run of completions is processed go
+ * to the kernel in the one io_uring_submit_and_wait() call that also
+ * waits for the next run.  There is one ring, run by the one thread,
+ * so the engine is not built with the multi-worker server mode.  If
+ * the ring cannot be set up, uring_run() says so and returns, and
+ * main() goes on with the kernel loop.
+ */
+#define NRING 1024 /* submission queue entries */
+#define NRBUF 512  /* provided receive buffers (power of 2) */
+#define NSEND 256  /* send slots in flight */
+#define BGID 0     /* provided buffer group ID */
+
+/*
+ * Completion tags.  The send slot index is or'ed into T_SEND.
+ */
+#define T_RECV 0x10000 /* multishot receive */
+#define T_TICK 0x20000 /* one-second timer */
+#define T_SEND 0x40000 /* send slot */
+#define T_MASK 0xffff  /* send slot mask */
+
+/*
+ * Send slot.  The message header, address and buffer must stay put
+ * until the send completes.
+ */
+struct slot
+{
+    struct msghdr msg;          /* message header */
+    struct iovec iov;           /* transmit vector */
+    struct sockaddr_in name;    /* destination address */
+    unsigned char buf[LEN_BUF]; /* transmit buffer */
+};
+
+static struct io_uring ring;                 /* the ring */
+static int usock = -1;                       /* socket descriptor */
+static struct io_uring_buf_ring *brg;        /* provided buffer ring */
+static unsigned char rbuf[NRBUF][LEN_BUF];   /* receive buffers */
+static struct msghdr rmsg;                   /* receive template */
+static struct slot slots[NSEND];             /* send slots */
+static int sfree[NSEND], nsfree;             /* free send slots */
+static struct __kernel_timespec tick = {1, 0}; /* timer interval */
+
+/*
+ * uring_sqe - get a submission queue entry, flushing if full
+ */
+static struct io_uring_sqe *
+uring_sqe()
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = io_uring_get_sqe(&ring)) == NULL)
+        io_uring_submit(&ring);
+    return (sqe);
+}
+
+/*
+ * uring_recv - arm the multishot receive
+ */
+static void uring_recv()
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe();
+    io_uring_prep_recvmsg_multishot(sqe, usock, &rmsg, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    io_uring_sqe_set_data64(sqe, T_RECV);
+}
+
+/*
+ * uring_tick - arm the one-second timer
+ */
+static void uring_tick()
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe();
+    io_uring_prep_timeout(sqe, &tick, 0, IORING_TIMEOUT_MULTISHOT);
+    io_uring_sqe_set_data64(sqe, T_TICK);
+}
+
+/*
+ * uring_packet - decode a received packet and pass it on
+ */
+static void uring_packet(
+    struct io_uring_cqe *cqe /* completion pointer */
+)
+{
+    struct io_uring_recvmsg_out *o;
+    struct sockaddr_in *sin;
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+    struct r r;
+    int bid;
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    o = io_uring_recvmsg_validate(rbuf[bid], cqe->res, &rmsg);
+    if (o != NULL && !(o->flags & MSG_TRUNC) &&
+        decode_packet(&r, io_uring_recvmsg_payload(o, &rmsg),
+                      io_uring_recvmsg_payload_length(o, cqe->res,
+                                                      &rmsg)))
+    {
+        sin = io_uring_recvmsg_name(o);
+        r.srcaddr = sin->sin_addr.s_addr;
+        r.srcport = ntohs(sin->sin_port);
+        r.dstaddr = 0;
+        r.dst = 0;
+
+        /*
+         * The kernel receive timestamp rides along in the control
+         * message, as with recv_batch().
+         */
+        for (cmsg = io_uring_recvmsg_cmsg_firsthdr(o, &rmsg);
+             cmsg != NULL;
+             cmsg = io_uring_recvmsg_cmsg_nexthdr(o, &rmsg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                r.dst = N2LFP(ts);
+            }
+        }
+        if (r.dst == 0)
+            r.dst = get_time();
+        receive(&r);
+    }
+
+    /*
+     * Give the buffer back to the kernel.
+     */
+    io_uring_buf_ring_add(brg, rbuf[bid], LEN_BUF, bid,
+                          io_uring_buf_ring_mask(NRBUF), 0);
+    io_uring_buf_ring_advance(brg, 1);
+}
+
+/*
+ * uring_xmit - queue a packet on the ring
+ */
+int /* TRUE if queued, FALSE if no ring */
+uring_xmit(struct x *x /* transmit packet pointer */)
+{
+    struct io_uring_sqe *sqe;
+    struct slot *sp;
+    int i;
+
+    if (usock < 0)
+        return (FALSE);
+
+    /*
+     * If every slot is still in flight, the packet is dropped, just
+     * as the kernel would drop it with a full socket buffer.
+     */
+    if (nsfree == 0)
+        return (TRUE);
+
+    i = sfree[--nsfree];
+    sp = &slots[i];
+    memset(&sp->name, 0, sizeof(sp->name));
+    sp->name.sin_family = AF_INET;
+    sp->name.sin_port = htons(x->dstport);
+    sp->name.sin_addr.s_addr = x->dstaddr;
+    sp->iov.iov_len = encode_packet(x, sp->buf);
+
+    sqe = uring_sqe();
+    io_uring_prep_sendmsg(sqe, usock, &sp->msg, 0);
+    io_uring_sqe_set_data64(sqe, T_SEND | i);
+    return (TRUE);
+}
+
+/*
+ * uring_run - run the receive loop and timer on an io_uring
+ *
+ * This returns only if the ring cannot be set up.
+ */
+void uring_run(int fd /* socket descriptor */)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, count;
+    unsigned long long tag;
+    int i, ret;
+
+    ret = io_uring_queue_init(NRING, &ring, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "io_uring setup: %s\n", strerror(-ret));
+        return;
+    }
+
+    /*
+     * Register the receive buffers with the kernel as a provided
+     * buffer ring.
+     */
+    brg = io_uring_setup_buf_ring(&ring, NRBUF, BGID, 0, &ret);
+    if (brg == NULL)
+    {
+        fprintf(stderr, "io_uring buffer ring: %s\n", strerror(-ret));
+        io_uring_queue_exit(&ring);
+        return;
+    }
+
+    for (i = 0; i < NRBUF; i++)
+        io_uring_buf_ring_add(brg, rbuf[i], LEN_BUF, i,
+                              io_uring_buf_ring_mask(NRBUF), i);
+    io_uring_buf_ring_advance(brg, NRBUF);
+
+    /*
+     * The receive template tells the kernel how much room to leave
+     * for the source address and control messages at the front of
+     * each buffer.
+     */
+    memset(&rmsg, 0, sizeof(rmsg));
+    rmsg.msg_namelen = sizeof(struct sockaddr_in);
+    rmsg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+
+    for (i = 0; i < NSEND; i++)
+    {
+        slots[i].iov.iov_base = slots[i].buf;
+        slots[i].msg.msg_name = &slots[i].name;
+        slots[i].msg.msg_namelen = sizeof(slots[i].name);
+        slots[i].msg.msg_iov = &slots[i].iov;
+        slots[i].msg.msg_iovlen = 1;
+        sfree[i] = i;
+    }
+    nsfree = NSEND;
+    usock = fd;
+
+    uring_recv();
+    uring_tick();
+    while (1)
+    {
+        key_quiesce();
+        io_uring_submit_and_wait(&ring, 1);
+        count = 0;
+        io_uring_for_each_cqe(&ring, head, cqe)
+        {
+            count++;
+            tag = io_uring_cqe_get_data64(cqe);
+            if (tag == T_RECV)
+            {
+                /*
+                 * The multishot receive drops out when it runs
+                 * out of buffers or hits an error.  Rearm it.
+                 */
+                if (cqe->res >= 0 && cqe->flags & IORING_CQE_F_BUFFER)
+                    uring_packet(cqe);
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    uring_recv();
+            }
+            else if (tag == T_TICK)
+            {
+                clock_adjust();
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    uring_tick();
+            }
+            else if (tag & T_SEND)
+            {
+                sfree[nsfree++] = tag & T_MASK;
+            }
+        }
+        io_uring_cq_advance(&ring, count);
+    }
+}
\ No newline at end of file
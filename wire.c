@@ -0,0 +1,221 @@
+#include "global.c";
+#include <endian.h> /* for be32toh() and friends */
+
+/*
+ * Packet wire format.  The NTP header is 48 octets in network byte
+ * order, followed by optional extension fields and an optional MAC.
+ * The MAC is the 32-bit key ID followed by the 128-bit digest; a
+ * crypto-NAK has the key ID only.  An extension field (RFC 7822) is a
+ * 16-bit type and a 16-bit length, which covers the whole field and is
+ * a multiple of four octets and at least 16.  A MAC is told from an
+ * extension field by being no more than LEN_MAC octets before the end.
+ *
+ *  0                   1                   2                   3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |LI | VN  |Mode |    Stratum    |     Poll      |  Precision    |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                    Root Delay, Root Dispersion                |
+ * |                         Reference ID                          |
+ * |      Reference, Origin, Receive and Transmit Timestamps       |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * The header structure below overlays the packet buffer, so decoding
+ * and encoding are one load or store per field, with the byte swap
+ * done by be32toh() and friends, which compile to a single
+ * instruction or to nothing.  There is no copying into an intermediate
+ * buffer and no branching on the field values.  The reference ID is
+ * left in network byte order, like the IPv4 addresses it often holds.
+ */
+#define LEN_NAK 4  /* crypto-NAK MAC length (octets) */
+#define LEN_MAC 20 /* MAC length (octets) */
+#define LEN_EF 16  /* shortest extension field (octets) */
+
+struct h
+{
+  unsigned char lvm;      /* leap, version, mode */
+  unsigned char stratum;  /* stratum */
+  signed char poll;       /* poll interval */
+  signed char precision;  /* precision */
+  unsigned int rootdelay; /* root delay */
+  unsigned int rootdisp;  /* root dispersion */
+  unsigned int refid;     /* reference ID */
+  tstamp reftime;         /* reference time */
+  tstamp org;             /* origin timestamp */
+  tstamp rec;             /* receive timestamp */
+  tstamp xmt;             /* transmit timestamp */
+} __attribute__((packed));
+
+/*
+ * MAC.  It follows the header at an offset that is a multiple of four
+ * octets.
+ */
+struct mac
+{
+  unsigned int keyid;  /* key ID */
+  unsigned char d[16]; /* message digest */
+} __attribute__((packed));
+
+/*
+ * decode_packet() - decode received packet
+ */
+int /* TRUE if valid format, FALSE if not */
+decode_packet(
+    struct r *r,        /* receive packet pointer */
+    unsigned char *buf, /* packet buffer */
+    int len             /* packet length */
+)
+{
+    struct h *h = (struct h *)buf;
+    struct mac *m;
+    int n, eflen;
+
+    /*
+     * The format checks are length only.  Walk the extension fields,
+     * if any; anything after them must be a MAC.  What the fields say
+     * is left to nts_serve().
+     */
+    if (len < LEN_PKT)
+        return (FALSE);
+
+    for (n = LEN_PKT; len - n > LEN_MAC; n += eflen)
+    {
+        eflen = be16toh(*(unsigned short *)(buf + n + 2));
+        if (eflen < LEN_EF || eflen % 4 != 0 || eflen > len - n)
+            return (FALSE);
+    }
+    r->maclen = len - n;
+    if (r->maclen != 0 && r->maclen != LEN_NAK && r->maclen != LEN_MAC)
+        return (FALSE);
+
+    m = (struct mac *)(buf + n);
+    r->pkt = buf;
+    r->len = n;
+    r->eflen = n - LEN_PKT;
+    r->auth = A_UNKNOWN;
+    r->nts = NULL;
+
+    r->leap = h->lvm >> 6;
+    r->version = (h->lvm >> 3) & 0x7;
+    r->mode = h->lvm & 0x7;
+    r->stratum = h->stratum;
+    r->poll = h->poll;
+    r->precision = h->precision;
+    r->rootdelay = be32toh(h->rootdelay);
+    r->rootdisp = be32toh(h->rootdisp);
+    r->refid = h->refid;
+    r->reftime = be64toh(h->reftime);
+    r->org = be64toh(h->org);
+    r->rec = be64toh(h->rec);
+    r->xmt = be64toh(h->xmt);
+
+    /*
+     * The r structures are reused from packet to packet, so a packet
+     * without a MAC must not keep the key ID and digest of one that
+     * came before.
+     */
+    r->keyid = 0;
+    if (r->maclen >= LEN_NAK)
+        r->keyid = be32toh(m->keyid);
+    if (r->maclen == LEN_MAC)
+        memcpy(&r->mac, m->d, sizeof(r->mac));
+    else
+        memset(&r->mac, 0, sizeof(r->mac));
+    return (TRUE);
+}
+
+/*
+ * encode_header() - encode transmit packet but for the MAC digest
+ *
+ * The digest is left to the caller, which can then compute the
+ * digests of a whole transmit batch together with mac_batch().
+ */
+int /* packet length */
+encode_header(
+    struct x *x,       /* transmit packet pointer */
+    unsigned char *buf /* packet buffer */
+)
+{
+    struct h *h = (struct h *)buf;
+    struct mac *m = (struct mac *)(buf + LEN_PKT);
+
+    /*
+     * With a header template the system variables are already in
+     * wire format and only the leap indicator is in the first octet.
+     */
+    if (x->hdr != NULL)
+    {
+        memcpy(h, x->hdr, LEN_PKT);
+        h->lvm |= (x->version & 0x7) << 3 | (x->mode & 0x7);
+        h->poll = x->poll;
+    }
+    else
+    {
+        h->lvm = x->leap << 6 | (x->version & 0x7) << 3 | (x->mode & 0x7);
+        h->stratum = x->stratum;
+        h->poll = x->poll;
+        h->precision = x->precision;
+        h->rootdelay = htobe32(x->rootdelay);
+        h->rootdisp = htobe32(x->rootdisp);
+        h->refid = x->refid;
+        h->reftime = htobe64(x->reftime);
+    }
+    h->org = htobe64(x->org);
+    h->rec = htobe64(x->rec);
+    h->xmt = htobe64(x->xmt);
+
+    /*
+     * An NTS reply carries its own authentication in its extension
+     * fields and has no MAC.
+     */
+    if (x->nts != NULL)
+        return (LEN_PKT + nts_encode(x->nts, buf));
+
+    if (x->maclen >= LEN_NAK)
+        m->keyid = htobe32(x->keyid);
+    return (LEN_PKT + x->maclen);
+}
+
+/*
+ * encode_packet() - encode transmit packet
+ */
+int /* packet length */
+encode_packet(
+    struct x *x,       /* transmit packet pointer */
+    unsigned char *buf /* packet buffer */
+)
+{
+    struct mac *m = (struct mac *)(buf + LEN_PKT);
+    int len;
+
+    len = encode_header(x, buf);
+    if (x->maclen == LEN_MAC && !mac(x->keyid, buf, LEN_PKT, (digest *)m->d))
+        memset(m->d, 0, sizeof(m->d));
+    return (len);
+}
+
+/*
+ * encode_system() - encode reply header template
+ *
+ * The system variables in the header change only in clock_update()
+ * and, for the root dispersion, once a second in clock_adjust().  They
+ * are encoded here once per change rather than once per packet, which
+ * takes the fixed-point conversions off the reply path.  The version,
+ * mode, poll and timestamps are left for encode_packet().
+ */
+void encode_system(unsigned char *buf /* template buffer */)
+{
+    struct h *h = (struct h *)buf;
+
+    memset(h, 0, LEN_PKT);
+    h->lvm = s.leap << 6;
+    if (s.stratum == MAXSTRAT)
+        h->stratum = 0;
+    else
+        h->stratum = s.stratum;
+    h->precision = s.precision;
+    h->rootdelay = htobe32(D2FP(s.rootdelay));
+    h->rootdisp = htobe32(D2FP(s.rootdisp));
+    h->refid = s.refid;
+    h->reftime = htobe64(s.reftime);
+}
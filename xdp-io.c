@@ -0,0 +1,419 @@
+#include "global.c";
+#if __has_include(<xdp/xsk.h>) && __has_include(<bpf/bpf.h>)
+#include <bpf/bpf.h>        /* for bpf_prog_load() and friends */
+#include <linux/if_ether.h> /* for ethhdr */
+#include <linux/ip.h>       /* for iphdr */
+#include <linux/udp.h>      /* for udphdr */
+#include <net/if.h>         /* for if_nametoindex() */
+#include <netinet/in.h>     /* for IPPROTO_UDP and friends */
+#include <stddef.h>         /* for offsetof() */
+#include <sys/epoll.h>      /* for epoll_wait() and friends */
+#include <sys/mman.h>       /* for mmap() */
+#include <sys/socket.h>     /* for sendto() and recvfrom() */
+#include <time.h>           /* for clock_gettime() */
+#include <xdp/xsk.h>        /* for AF_XDP sockets */
+
+/*
+ * AF_XDP engine.  This is an optional transport for the server fast
+ * path on the busiest hosts, selected at compile time with XDP.
+ * Frames move between the NIC and a shared memory area (UMEM) with
+ * no trip through the kernel UDP stack.  A small parser picks out
+ * IPv4 UDP frames for the NTP port and passes them to receive().  The
+ * reply built by fast_xmit() is encoded back into the very frame the
+ * request came in, with the addresses swapped, and that frame goes
+ * straight to the transmit ring.  Nothing is copied in either
+ * direction.
+ *
+ * Packets that are not replies to the frame at hand, such as those
+ * sent by peer_xmit() from the poll process, would need a route and
+ * neighbor lookup, so they go out through the regular socket instead.
+ *
+ * A small XDP program of our own, assembled in xdp_prog(), sends
+ * the IPv4 UDP frames for the NTP port on the chosen queue to the
+ * socket and passes everything else, ARP and SSH included, on to the
+ * kernel stack as if nothing were attached.  libxdp is told not to
+ * load its default program, which would take every frame on the
+ * queue.  An ethtool ntuple rule steering UDP port 123 to the queue
+ * puts all of the NTP traffic on this path.  A veth pair in a network
+ * namespace makes a convenient test bed with no special NIC:
+ *
+ *   ip netns add ntp
+ *   ip link add veth0 type veth peer name veth1 netns ntp
+ *   ip addr add 10.0.0.1/24 dev veth0
+ *   ip link set veth0 up
+ *   ip -n ntp addr add 10.0.0.2/24 dev veth1
+ *   ip -n ntp link set veth1 up
+ *
+ * then run the server with XDPDEV "veth0" and query 10.0.0.1 from any
+ * NTP client run with ip netns exec ntp.  veth does not do zero-copy,
+ * so the socket falls back to copy mode there.
+ *
+ * The engine serves one queue of one interface with one thread.  The
+ * NIC strikes no timestamps that reach us here, so each batch is
+ * stamped with get_time() as it is taken off the ring, and the time
+ * a frame waited in the ring ends up in the client's delay.  It needs
+ * the libxdp and libbpf headers and libraries.  Without the headers
+ * this file builds to nothing, and a build with XDP stops here.
+ */
+#define NFRAME XSK_RING_PROD__DEFAULT_NUM_DESCS /* UMEM frames */
+#define FRAME XSK_UMEM__DEFAULT_FRAME_SIZE      /* frame size (octets) */
+#define NRING XSK_RING_CONS__DEFAULT_NUM_DESCS  /* ring entries */
+#define UDPOFS (sizeof(struct ethhdr) + sizeof(struct iphdr) + \
+                sizeof(struct udphdr)) /* NTP payload offset */
+
+/*
+ * The frames are never more than the fill ring holds, so refilling it
+ * always succeeds.
+ */
+static struct xsk_umem *umem;   /* UMEM handle */
+static unsigned char *area;     /* UMEM area */
+static struct xsk_ring_prod fq; /* fill ring */
+static struct xsk_ring_cons cq; /* completion ring */
+static struct xsk_socket *xsk;  /* AF_XDP socket */
+static struct xsk_ring_cons rx; /* receive ring */
+static struct xsk_ring_prod tx; /* transmit ring */
+static unsigned long long cur;  /* current frame address */
+static unsigned char *curpkt;   /* current frame data */
+static int curused;             /* current frame sent as reply */
+static int xfd = -1;            /* AF_XDP socket descriptor */
+
+/*
+ * XDP program instructions.  Every test that fails jumps forward to
+ * the XDP_PASS exit at PASS, given the index of the jump.
+ */
+#define PASS 22 /* index of XDP_PASS exit */
+#define LDX(size, dst, src, off)                                  \
+  ((struct bpf_insn){BPF_LDX | BPF_MEM | (size), (dst), (src), (off), 0})
+#define JNE(dst, imm, at)                                         \
+  ((struct bpf_insn){BPF_JMP | BPF_JNE | BPF_K, (dst), 0,         \
+                     PASS - (at) - 1, (imm)})
+#define ALU(op, dst, imm)                                         \
+  ((struct bpf_insn){BPF_ALU64 | (op) | BPF_K, (dst), 0, 0, (imm)})
+#define IPOFS sizeof(struct ethhdr)            /* IP header offset */
+#define UDPHOFS (IPOFS + sizeof(struct iphdr)) /* UDP header offset */
+
+/*
+ * xdp_prog - load the XDP program for socket map map
+ *
+ * The tests are those of xdp_parse(): an Ethernet frame long enough
+ * for the headers, IPv4 with no options (0x45), UDP, not a fragment
+ * and the NTP port, so a frame the program sends to the socket is one
+ * the parser takes.  The queue of the frame indexes the map, and a
+ * queue with no socket in it passes the frame, as does every queue
+ * once the server is gone.
+ */
+static int /* program descriptor or -1 */
+xdp_prog(int map /* socket map descriptor */)
+{
+    struct bpf_insn prog[] = {
+        /* 0 */ LDX(BPF_W, 2, 1, offsetof(struct xdp_md, data)),
+        /* 1 */ LDX(BPF_W, 3, 1, offsetof(struct xdp_md, data_end)),
+        /* 2 */ {BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0},
+        /* 3 */ ALU(BPF_ADD, 4, UDPOFS),
+        /* 4 */ {BPF_JMP | BPF_JGT | BPF_X, 4, 3, PASS - 5, 0},
+        /* 5 */ LDX(BPF_H, 5, 2, offsetof(struct ethhdr, h_proto)),
+        /* 6 */ JNE(5, htons(ETH_P_IP), 6),
+        /* 7 */ LDX(BPF_B, 5, 2, IPOFS),
+        /* 8 */ JNE(5, 0x45, 8),
+        /* 9 */ LDX(BPF_B, 5, 2, IPOFS + offsetof(struct iphdr, protocol)),
+        /* 10 */ JNE(5, IPPROTO_UDP, 10),
+        /* 11 */ LDX(BPF_H, 5, 2, IPOFS + offsetof(struct iphdr, frag_off)),
+        /* 12 */ ALU(BPF_AND, 5, htons(0x3fff)),
+        /* 13 */ JNE(5, 0, 13),
+        /* 14 */ LDX(BPF_H, 5, 2, UDPHOFS + offsetof(struct udphdr, dest)),
+        /* 15 */ JNE(5, htons(PORT), 15),
+        /* 16 */ LDX(BPF_W, 2, 1, offsetof(struct xdp_md, rx_queue_index)),
+        /* 17 */ {BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map},
+        /* 18 */ {0, 0, 0, 0, 0},
+        /* 19 */ {BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS},
+        /* 20 */ {BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map},
+        /* 21 */ {BPF_JMP | BPF_EXIT, 0, 0, 0, 0},
+        /* 22 */ {BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS},
+        /* 23 */ {BPF_JMP | BPF_EXIT, 0, 0, 0, 0},
+    };
+
+    return (bpf_prog_load(BPF_PROG_TYPE_XDP, "ntp", "Dual BSD/GPL",
+                          prog, sizeof(prog) / sizeof(prog[0]), NULL));
+}
+
+/*
+ * xdp_fill - give frames to the kernel for receiving
+ */
+static void xdp_fill(
+    unsigned long long *addr, /* frame addresses */
+    int n                     /* number of frames */
+)
+{
+    unsigned int idx;
+    int i;
+
+    while (xsk_ring_prod__reserve(&fq, n, &idx) != n)
+        ;
+    for (i = 0; i < n; i++)
+        *xsk_ring_prod__fill_addr(&fq, idx++) = addr[i];
+    xsk_ring_prod__submit(&fq, n);
+}
+
+/*
+ * xdp_parse - find the NTP payload in a frame
+ *
+ * Only plain IPv4 UDP frames for the NTP port qualify.  Fragments and
+ * IP options are not worth the trouble.
+ */
+static unsigned char * /* NTP payload or NULL */
+xdp_parse(
+    unsigned char *pkt, /* frame data */
+    int len,            /* frame length */
+    int *plen           /* payload length (returned) */
+)
+{
+    struct ethhdr *eth = (struct ethhdr *)pkt;
+    struct iphdr *ip = (struct iphdr *)(eth + 1);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+    if (len < (int)UDPOFS || eth->h_proto != htons(ETH_P_IP))
+        return (NULL);
+
+    if (ip->version != 4 || ip->ihl != 5 || ip->protocol != IPPROTO_UDP ||
+        ip->frag_off & htons(0x3fff))
+        return (NULL);
+
+    if (udp->dest != htons(PORT) || ntohs(udp->len) < sizeof(*udp) ||
+        ntohs(udp->len) > len - (sizeof(*eth) + sizeof(*ip)))
+        return (NULL);
+
+    *plen = ntohs(udp->len) - sizeof(*udp);
+    return ((unsigned char *)(udp + 1));
+}
+
+/*
+ * xdp_xmit - send reply in the current frame
+ */
+int /* TRUE if sent, FALSE if not a reply */
+xdp_xmit(struct x *x /* transmit packet pointer */)
+{
+    struct ethhdr *eth = (struct ethhdr *)curpkt;
+    struct iphdr *ip = (struct iphdr *)(eth + 1);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    struct xdp_desc *d;
+    unsigned char mac[ETH_ALEN];
+    unsigned int idx, sum;
+    unsigned short *w;
+    int len, i;
+
+    if (curpkt == NULL || curused || x->dstaddr != ip->saddr ||
+        x->dstport != ntohs(udp->source))
+        return (FALSE);
+
+    if (xsk_ring_prod__reserve(&tx, 1, &idx) != 1)
+        return (TRUE); /* ring full, drop */
+
+    /*
+     * Turn the request frame around.  The UDP checksum is optional
+     * for IPv4 and left zero; the IP header checksum is recomputed
+     * over its ten words.
+     */
+    len = encode_packet(x, (unsigned char *)(udp + 1));
+    memcpy(mac, eth->h_dest, ETH_ALEN);
+    memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+    memcpy(eth->h_source, mac, ETH_ALEN);
+
+    ip->daddr = ip->saddr;
+    ip->saddr = x->srcaddr;
+    ip->tot_len = htons(sizeof(*ip) + sizeof(*udp) + len);
+    ip->id = 0;
+    ip->ttl = 64;
+    ip->check = 0;
+    for (sum = 0, w = (unsigned short *)ip, i = 0; i < 10; i++)
+        sum += w[i];
+    sum = (sum & 0xffff) + (sum >> 16);
+    ip->check = ~((sum & 0xffff) + (sum >> 16));
+
+    udp->dest = udp->source;
+    udp->source = htons(PORT);
+    udp->len = htons(sizeof(*udp) + len);
+    udp->check = 0;
+
+    d = xsk_ring_prod__tx_desc(&tx, idx);
+    d->addr = cur;
+    d->len = UDPOFS + len;
+    xsk_ring_prod__submit(&tx, 1);
+    curused = TRUE;
+    return (TRUE);
+}
+
+/*
+ * xdp_run - run the receive loop on an AF_XDP socket
+ */
+void xdp_run(
+    char *ifname, /* interface name */
+    int queue     /* interface queue */
+)
+{
+    struct xsk_socket_config scfg;
+    struct epoll_event ev;
+    struct timespec now, tick;
+    unsigned long long addr[NBATCH]; /* frames to refill */
+    const struct xdp_desc *d;
+    struct iphdr *ip;
+    struct udphdr *udp;
+    unsigned char *pkt;
+    unsigned int idx;
+    tstamp dst;
+    struct r r;
+    int n, m, i, plen, ep, ms;
+    int ifindex, map, prog;
+
+    /*
+     * Map the UMEM and hand all the frames to the fill ring.
+     */
+    area = mmap(NULL, (size_t)NFRAME * FRAME, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        return;
+
+    if (xsk_umem__create(&umem, area, (size_t)NFRAME * FRAME, &fq, &cq,
+                         NULL) < 0)
+        return;
+
+    /*
+     * Try zero-copy first.  Drivers that cannot do it, veth among
+     * them, get copy mode.  The socket goes in our own map rather
+     * than the one of the libxdp default program.
+     */
+    ifindex = if_nametoindex(ifname);
+    if (ifindex == 0)
+        return;
+
+    map = bpf_map_create(BPF_MAP_TYPE_XSKMAP, "ntp_xsks", sizeof(int),
+                         sizeof(int), queue + 1, NULL);
+    if (map < 0)
+        return;
+
+    memset(&scfg, 0, sizeof(scfg));
+    scfg.rx_size = NRING;
+    scfg.tx_size = NRING;
+    scfg.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;
+    scfg.bind_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+    if (xsk_socket__create(&xsk, ifname, queue, umem, &rx, &tx,
+                           &scfg) < 0)
+    {
+        scfg.bind_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        if (xsk_socket__create(&xsk, ifname, queue, umem, &rx, &tx,
+                               &scfg) < 0)
+            return;
+    }
+    xfd = xsk_socket__fd(xsk);
+
+    /*
+     * Only now, with the socket in the map, is the program attached
+     * and the NTP frames taken off the kernel stack.
+     */
+    if (xsk_socket__update_xskmap(xsk, map) < 0)
+        return;
+
+    prog = xdp_prog(map);
+    if (prog < 0 || bpf_xdp_attach(ifindex, prog, 0, NULL) < 0)
+        return;
+
+    for (i = 0; i < NFRAME; i += n)
+    {
+        n = min(NBATCH, NFRAME - i);
+        for (m = 0; m < n; m++)
+            addr[m] = (unsigned long long)(i + m) * FRAME;
+        xdp_fill(addr, n);
+    }
+
+    ep = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.fd = xfd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, xfd, &ev);
+
+    /*
+     * The one-second timer is run from the loop as well.  Waiting
+     * for packets never goes past the next tick.
+     */
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    tick.tv_sec++;
+    while (1)
+    {
+        key_quiesce();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > tick.tv_sec ||
+            (now.tv_sec == tick.tv_sec && now.tv_nsec >= tick.tv_nsec))
+        {
+            clock_adjust();
+            tick.tv_sec++;
+            continue;
+        }
+
+        n = xsk_ring_cons__peek(&rx, NBATCH, &idx);
+        if (n == 0)
+        {
+            if (xsk_ring_prod__needs_wakeup(&fq))
+                recvfrom(xfd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+            ms = (tick.tv_sec - now.tv_sec) * 1000 +
+                 (tick.tv_nsec - now.tv_nsec) / 1000000 + 1;
+            epoll_wait(ep, &ev, 1, ms);
+            continue;
+        }
+
+        /*
+         * There is no kernel receive timestamp on this path, so the
+         * whole batch is stamped on arrival here.
+         */
+        dst = get_time();
+        m = 0;
+        for (i = 0; i < n; i++)
+        {
+            d = xsk_ring_cons__rx_desc(&rx, idx++);
+            cur = d->addr;
+            curpkt = xsk_umem__get_data(area, d->addr);
+            curused = FALSE;
+            pkt = xdp_parse(curpkt, d->len, &plen);
+            if (pkt != NULL && decode_packet(&r, pkt, plen))
+            {
+                ip = (struct iphdr *)(curpkt + sizeof(struct ethhdr));
+                udp = (struct udphdr *)(ip + 1);
+                r.srcaddr = ip->saddr;
+                r.dstaddr = ip->daddr;
+                r.srcport = ntohs(udp->source);
+                r.dst = dst;
+                receive(&r);
+            }
+
+            /*
+             * A frame that did not go out as a reply goes back to
+             * the fill ring.
+             */
+            if (!curused)
+                addr[m++] = cur;
+        }
+        curpkt = NULL;
+        xsk_ring_cons__release(&rx, n);
+        if (m > 0)
+            xdp_fill(addr, m);
+
+        /*
+         * Kick the transmitter if it asks for it, then return the
+         * frames of completed transmissions to the fill ring.
+         */
+        if (xsk_ring_prod__needs_wakeup(&tx))
+            sendto(xfd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        n = xsk_ring_cons__peek(&cq, NBATCH, &idx);
+        for (i = 0; i < n; i++)
+            addr[i] = *xsk_ring_cons__comp_addr(&cq, idx++);
+        xsk_ring_cons__release(&cq, n);
+        if (n > 0)
+            xdp_fill(addr, n);
+
+        /*
+         * Anything the poll process or the replies sent through
+         * the socket queued goes out now.
+         */
+        xmit_flush();
+    }
+}
+#elif defined(XDP)
+#error "XDP needs the libxdp and libbpf headers"
+#endif